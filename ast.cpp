@@ -1,5 +1,18 @@
 
 #include "ast.hpp"
+#include "debuginfo.hpp"
+#include "eval.hpp"
+#include "mathlib.hpp"
+#include "profile.hpp"
+#include "purity.hpp"
+#include "stats.hpp"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/SCCP.h"
+#include <cmath>
 #include <iostream>
 
 // LLVMContext is necessary for managing the LLVM context
@@ -28,52 +41,115 @@ std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
 std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
 std::unique_ptr<llvm::StandardInstrumentations> TheSI;
 std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+std::map<std::string, std::unique_ptr<FunctionAST>> FunctionDefs;
+std::set<std::string> HostFunctions;
+std::set<std::string> ImportedFunctions;
 
 llvm::ExitOnError ExitOnErr;
 
+thread_local llvm::raw_ostream *Diagnostics = nullptr;
+bool FastReductions = false;
+Precision DefaultPrecision = Precision::F64;
+Precision CurPrecision = Precision::F64;
+
 using namespace llvm;
 
+Type *numTy() {
+    return CurPrecision == Precision::F32 ? Type::getFloatTy(*TheContext)
+                                          : Type::getDoubleTy(*TheContext);
+}
+
+Value *toNum(Value *V) {
+    return CurPrecision == Precision::F32 ? Builder->CreateFPTrunc(V, numTy(), "tonum") : V;
+}
+
+Value *toDouble(Value *V) {
+    return V->getType()->isFloatTy()
+               ? Builder->CreateFPExt(V, Type::getDoubleTy(*TheContext), "todouble")
+               : V;
+}
+
 // NumberExprAST implementation
-Value *NumberExprAST::codegen() { return ConstantFP::get(*TheContext, APFloat(Val)); }
+Value *NumberExprAST::codegen() { return ConstantFP::get(numTy(), Val); }
 
 // VariableExprAST implementation
 Value *VariableExprAST::codegen() {
     // Look this variable up in the NamedValues map.
     Value *V = NamedValues[Name];
-    return V ? V : ConstantFP::get(*TheContext, APFloat(0.0));
+    return V ? V : ConstantFP::get(numTy(), 0.0);
 }
 
 // BinaryExprAST implementation
+BinaryExprAST::~BinaryExprAST() {
+    // Take the operator nodes below apart one at a time, so that freeing a
+    // deep tree doesn't recurse through the destructors.
+    if (!LHS && !RHS)
+        return;
+    std::vector<std::unique_ptr<ExprAST>> Pending;
+    Pending.push_back(std::move(LHS));
+    Pending.push_back(std::move(RHS));
+    while (!Pending.empty()) {
+        std::unique_ptr<ExprAST> E = std::move(Pending.back());
+        Pending.pop_back();
+        if (BinaryExprAST *B = E ? E->asBinary() : nullptr) {
+            Pending.push_back(std::move(B->LHS));
+            Pending.push_back(std::move(B->RHS));
+        }
+    }
+}
+
 Value *BinaryExprAST::codegen() {
-    Value *L = LHS->codegen();
-    Value *R = RHS->codegen();
-    if (!L || !R)
-        return nullptr;
+    auto Leaf = [](ExprAST &E) -> std::optional<Value *> {
+        if (Value *V = E.codegen())
+            return V;
+        return std::nullopt;
+    };
+    auto Combine = [](BinaryExprAST &B, Value *L, Value *R) -> std::optional<Value *> {
+        emitLocation(&B);
+        switch (B.Op) {
+        case '+':
+            return Builder->CreateFAdd(L, R, "addtmp");
+        case '-':
+            return Builder->CreateFSub(L, R, "subtmp");
+        case '*':
+            return Builder->CreateFMul(L, R, "multmp");
+        case '/':
+            return Builder->CreateFDiv(L, R, "divtmp");
+        case '<':
+            L = Builder->CreateFCmpULT(L, R, "cmptmp");
+            return Builder->CreateUIToFP(L, numTy(), "booltmp");
+        case '>':
+            L = Builder->CreateFCmpUGT(L, R, "cmptmp");
+            return Builder->CreateUIToFP(L, numTy(), "booltmp");
+        default:
+            LogErrorV("invalid binary operator");
+            return std::nullopt;
+        }
+    };
+    emitLocation(this);
+    return fold<Value *>(Leaf, Combine).value_or(nullptr);
+}
 
-    switch (Op) {
-    case '+':
-        return Builder->CreateFAdd(L, R, "addtmp");
-    case '-':
-        return Builder->CreateFSub(L, R, "subtmp");
-    case '*':
-        return Builder->CreateFMul(L, R, "multmp");
-    case '/':
-        return Builder->CreateFDiv(L, R, "divtmp");
-    case '<':
-        L = Builder->CreateFCmpULT(L, R, "cmptmp");
-        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-    case '>':
-        L = Builder->CreateFCmpUGT(L, R, "cmptmp");
-        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-    default:
-        return LogErrorV("invalid binary operator");
-    }
+Function *getFunction(const std::string &Name) {
+    // First, see if the function has already been added to the current module.
+    if (auto *F = TheModule->getFunction(Name))
+        return F;
+
+    // If not, check whether we can codegen the declaration from some existing
+    // prototype.
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end())
+        return FI->second->codegen();
+
+    // If no existing prototype exists, return null.
+    return nullptr;
 }
 
 // CallExprAST implementation
 Value *CallExprAST::codegen() {
-    // Look up the name in the global module table.
-    Function *CalleeF = TheModule->getFunction(Callee);
+    emitLocation(this);
+    // Look up the name in the current module or the known prototypes.
+    Function *CalleeF = getFunction(Callee);
     if (!CalleeF)
         return LogErrorV("Unknown function referenced");
 
@@ -81,14 +157,29 @@ Value *CallExprAST::codegen() {
     if (CalleeF->arg_size() != Args.size())
         return LogErrorV("Incorrect # arguments passed");
 
-    std::vector<Value *> ArgsV;
+    std::vector<Value *> ArgsV, WideArgsV;
     for (unsigned i = 0, e = Args.size(); i != e; ++i) {
         ArgsV.push_back(Args[i]->codegen());
         if (!ArgsV.back())
             return nullptr;
     }
 
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    // The arguments moved the location, the call belongs to this node.
+    emitLocation(this);
+    for (Value *V : ArgsV)
+        WideArgsV.push_back(toDouble(V));
+    if (Value *V = partiallyEvaluateCall(Callee, WideArgsV))
+        return toNum(V);
+    // Math builtins are computed at the precision of the caller.
+    if (Value *V = emitMathBuiltinCall(Callee, CalleeF, ArgsV))
+        return V;
+
+    auto *Call = Builder->CreateCall(CalleeF, WideArgsV, "calltmp");
+    // LLVM knows the libm names as well, keep it from treating a host or
+    // library function under one as the math function.
+    if (HostFunctions.count(Callee) || ImportedFunctions.count(Callee))
+        Call->addFnAttr(Attribute::NoBuiltin);
+    return toNum(Call);
 }
 
 // PrototypeAST implementation
@@ -104,16 +195,32 @@ Function *PrototypeAST::codegen() {
     unsigned Idx = 0;
     for (auto &Arg : F->args())
         Arg.setName(Args[Idx++]);
+    applyFunctionSummary(*F, getFunctionSummary(Name, Args.size()));
     return F;
 }
 
 Function *FunctionAST::codegen() {
-
-    // First, check for an existing function from a previous declaration.
-    Function *TheFunction = TheModule->getFunction(Proto->getName());
-
-    // if there is declaration, do nothing.
-    // it could imported using extern.
+    const std::string &Name = Proto->getName();
+
+    // The symbol already resolves to the host's function, so a stub for a
+    // body couldn't be defined.
+    if (HostFunctions.count(Name))
+        return (Function *)LogErrorV(
+            ("Function is provided by the host and cannot be defined: " + Name).c_str());
+
+    // A function may be redefined, but callers compiled against the old body
+    // keep calling through the same stub, so the arity has to stay put.
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end() && FI->second->getArgs().size() != Proto->getArgs().size())
+        return (Function *)LogErrorV(
+            ("Function cannot be redefined with a different number of arguments: " + Name)
+                .c_str());
+
+    // First, check for an existing function from a previous declaration in
+    // this module. it could imported using extern.
+    Function *TheFunction = TheModule->getFunction(Name);
+
+    // if there is no declaration, create one.
     if (!TheFunction)
         TheFunction = Proto->codegen();
 
@@ -121,10 +228,9 @@ Function *FunctionAST::codegen() {
     if (!TheFunction)
         return nullptr;
 
-    // if function body has already been generated, return err as we don't allow
-    // redefinition.
+    // if function body has already been generated in this module, return err.
     if (!TheFunction->empty())
-        return (Function *)LogErrorV(("Function cannot be redefined: " + Proto->getName()).c_str());
+        return (Function *)LogErrorV(("Function cannot be redefined: " + Name).c_str());
 
     // verify that the function args are the same
     if (TheFunction->arg_size() != Proto->getArgs().size()) {
@@ -135,19 +241,42 @@ Function *FunctionAST::codegen() {
             return (Function *)LogErrorV("Unknown variable name.");
         }
     }
+    // The declaration carries what was known about the previous body.
+    applyFunctionSummary(*TheFunction, inferFunctionSummary(*this));
+
+    // Register the prototype so later modules can declare the function, but
+    // keep the previous one around in case the body fails to generate.
+    // Top-level expressions can't be called, so they are left out.
+    bool IsTopLevel = Name == "__anon_expr";
+    CurPrecision = Proto->getPrecision();
+    std::unique_ptr<PrototypeAST> OldProto;
+    if (FI != FunctionProtos.end())
+        OldProto = std::move(FI->second);
+    if (!IsTopLevel)
+        FunctionProtos[Name] = std::make_unique<PrototypeAST>(*Proto);
 
     // Create a new basic block to start insertion into.
     BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
     Builder->SetInsertPoint(BB);
+    beginFunctionDebugInfo(TheFunction, *Proto);
+
+    // The prologue has no source location of its own.
+    emitLocation(nullptr);
+    beginProfiledFunction(Name);
+    profileFunctionEntry(TheFunction);
 
     // Record the function arguments in the NamedValues map.
     NamedValues.clear();
     for (auto &Arg : TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
+        NamedValues[std::string(Arg.getName())] = toNum(&Arg);
+    if (!IsTopLevel)
+        emitValueProfile(*this, TheFunction);
 
+    emitLocation(Body.get());
     if (Value *RetVal = Body->codegen()) {
 
-        Builder->CreateRet(RetVal);
+        Builder->CreateRet(toDouble(RetVal));
+        endFunctionDebugInfo();
 
         // validate the generated code, check for consistency.
         verifyFunction(*TheFunction);
@@ -158,25 +287,50 @@ Function *FunctionAST::codegen() {
         return TheFunction;
     }
 
-    // delete the function.
+    // delete the function and forget its prototype unless an earlier
+    // definition is still live.
+    endFunctionDebugInfo();
     TheFunction->eraseFromParent();
+    if (OldProto)
+        FunctionProtos[Name] = std::move(OldProto);
+    else if (!IsTopLevel)
+        FunctionProtos.erase(Name);
     return nullptr;
 }
 
 Value *IfExprAST::codegen() {
+    emitLocation(this);
     // evaluate the condition
     Value *CondV = Cond->codegen();
     if (!CondV)
         return nullptr;
 
-    CondV = Builder->CreateFCmpONE(CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+    CondV = Builder->CreateFCmpONE(CondV, ConstantFP::get(numTy(), 0.0), "ifcond");
+
+    // Cheap arms without side effects are both computed, and one is picked.
+    if (shouldUseSelect(*Then, *Else)) {
+        Value *ThenV = Then->codegen();
+        if (!ThenV)
+            return nullptr;
+        Value *ElseV = Else->codegen();
+        if (!ElseV)
+            return nullptr;
+        emitLocation(this);
+        Value *V = Builder->CreateSelect(CondV, ThenV, ElseV, "iftmp");
+        // Keep the backend from turning it back into a branch.
+        if (auto *SI = dyn_cast<SelectInst>(V))
+            SI->setMetadata(LLVMContext::MD_unpredictable,
+                            MDBuilder(*TheContext).createUnpredictable());
+        return V;
+    }
+
     Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
     BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
     BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
     BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+    profileBranch(Builder->CreateCondBr(CondV, ThenBB, ElseBB));
 
     Builder->SetInsertPoint(ThenBB);
 
@@ -200,20 +354,98 @@ Value *IfExprAST::codegen() {
     TheFunction->insert(TheFunction->end(), MergeBB);
     Builder->SetInsertPoint(MergeBB);
 
-    PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+    PHINode *PN = Builder->CreatePHI(numTy(), 2, "iftmp");
 
     PN->addIncoming(ThenV, ThenBB);
     PN->addIncoming(ElseV, ElseBB);
     return PN;
 }
 
+double ForExprAST::identity(Reduction R) {
+    switch (R) {
+    case Reduction::Prod:
+        return 1.0;
+    case Reduction::Min:
+        return INFINITY;
+    case Reduction::Max:
+        return -INFINITY;
+    default:
+        return 0.0;
+    }
+}
+
+double ForExprAST::reduce(Reduction R, double Acc, double V) {
+    switch (R) {
+    case Reduction::Sum:
+        return Acc + V;
+    case Reduction::Prod:
+        return Acc * V;
+    case Reduction::Min:
+        return std::fmin(Acc, V);
+    case Reduction::Max:
+        return std::fmax(Acc, V);
+    default:
+        return Acc;
+    }
+}
+
+// emitReduce combines the accumulator of a reduction with a value of its body.
+static Value *emitReduce(ForExprAST::Reduction R, Value *Acc, Value *V) {
+    IRBuilder<>::FastMathFlagGuard Guard(*Builder);
+    FastMathFlags FMF;
+    if (FastReductions) {
+        FMF.setNoSignedZeros();
+        if (R == ForExprAST::Reduction::Sum || R == ForExprAST::Reduction::Prod)
+            FMF.setAllowReassoc();
+        else
+            FMF.setNoNaNs();
+    }
+    Builder->setFastMathFlags(FMF);
+    switch (R) {
+    case ForExprAST::Reduction::Sum:
+        return Builder->CreateFAdd(Acc, V, "sum");
+    case ForExprAST::Reduction::Prod:
+        return Builder->CreateFMul(Acc, V, "prod");
+    case ForExprAST::Reduction::Min:
+        return Builder->CreateMinNum(Acc, V, "min");
+    default:
+        return Builder->CreateMaxNum(Acc, V, "max");
+    }
+}
+
 Value *ForExprAST::codegen() {
+    emitLocation(this);
     // evaluate the start
     Value *StartVal = Start->codegen();
     if (!StartVal)
         return nullptr;
     auto oldVal = NamedValues[VarName];
 
+    // A reduction carries its accumulator through the loop.
+    Value *Init = nullptr;
+    if (Kind != Reduction::None)
+        Init = ConstantFP::get(numTy(), identity(Kind));
+
+    ExprAST *Bound;
+    uint64_t StepN;
+    Value *Result = Init && isCounted(Bound, StepN)
+                        ? emitCountedLoop(StartVal, Init, *Bound, StepN)
+                        : emitLoop(StartVal, Init);
+    if (!Result)
+        return nullptr;
+
+    if (oldVal) {
+        NamedValues[VarName] = oldVal;
+    } else {
+        NamedValues.erase(VarName);
+    }
+    return Init ? Result : Constant::getNullValue(numTy());
+}
+
+// emitLoop emits the loop as written: the condition and step are evaluated on
+// every iteration. It returns the accumulator once the loop exits, or for a
+// plain loop, any non-null value.
+Value *ForExprAST::emitLoop(Value *StartVal, Value *Init) {
     // create the basic block
     Function *TheFunction = Builder->GetInsertBlock()->getParent();
     BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
@@ -226,8 +458,13 @@ Value *ForExprAST::codegen() {
     // Evaluate the condition
     Builder->SetInsertPoint(LoopBB);
 
-    PHINode *Variable = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, VarName.c_str());
+    PHINode *Variable = Builder->CreatePHI(numTy(), 2, VarName.c_str());
     Variable->addIncoming(StartVal, CurBB);
+    PHINode *Acc = nullptr;
+    if (Init) {
+        Acc = Builder->CreatePHI(numTy(), 2, "acc");
+        Acc->addIncoming(Init, CurBB);
+    }
 
     // set the variable
     NamedValues[VarName] = Variable;
@@ -235,13 +472,15 @@ Value *ForExprAST::codegen() {
     Value *CondV = Cond->codegen();
     if (!CondV)
         return nullptr;
-    CondV = Builder->CreateFCmpONE(CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+    CondV = Builder->CreateFCmpONE(CondV, ConstantFP::get(numTy(), 0.0), "loopcond");
     Builder->CreateCondBr(CondV, BodyBB, AfterBB);
 
     // Evaluate the body
     Builder->SetInsertPoint(BodyBB);
-    if (!Body->codegen())
+    Value *BodyV = Body->codegen();
+    if (!BodyV)
         return nullptr;
+    Value *AccNext = Acc ? emitReduce(Kind, Acc, BodyV) : nullptr;
     Builder->CreateBr(StepBB);
     // add the body block to the function
     TheFunction->insert(TheFunction->end(), BodyBB);
@@ -253,21 +492,157 @@ Value *ForExprAST::codegen() {
         return nullptr;
     Value *NextVar = Builder->CreateFAdd(Variable, StepVal, "nextvar");
     Variable->addIncoming(NextVar, Builder->GetInsertBlock());
+    if (Acc)
+        Acc->addIncoming(AccNext, Builder->GetInsertBlock());
 
     Builder->CreateBr(LoopBB);
     TheFunction->insert(TheFunction->end(), StepBB);
 
     // Evaluate the after loop
     Builder->SetInsertPoint(AfterBB);
-    if (oldVal) {
-        NamedValues[VarName] = oldVal;
+    TheFunction->insert(TheFunction->end(), AfterBB);
+    return Acc ? Acc : Variable;
+}
+
+// Set while emitting the fallback of a counted loop. Loops nested in it are
+// emitted as written, so that each level of nesting doesn't double the code.
+static bool InCountedFallback = false;
+
+// isCounted tells if the loop has the form `i = start, i < Bound, StepN`,
+// where Bound is a number or another variable and StepN a whole number.
+bool ForExprAST::isCounted(ExprAST *&Bound, uint64_t &StepN) {
+    // While profiling, both runs have to see the same code.
+    if (isProfiling() || InCountedFallback)
+        return false;
+    auto *C = Cond->asBinary();
+    if (!C || C->getOp() != '<')
+        return false;
+    auto *Var = C->getLHS()->asVariable();
+    if (!Var || Var->getName() != VarName)
+        return false;
+    Bound = C->getRHS();
+    auto *BoundVar = Bound->asVariable();
+    if (!Bound->asNumber() && !(BoundVar && BoundVar->getName() != VarName))
+        return false;
+    auto *S = Step->asNumber();
+    // Steps above 2^24 may not be whole numbers once rounded to a float.
+    double MaxStep = CurPrecision == Precision::F32 ? 0x1p24 : 0x1p31;
+    if (!S || S->getVal() < 1 || S->getVal() > MaxStep || std::floor(S->getVal()) != S->getVal())
+        return false;
+    StepN = S->getVal();
+    return true;
+}
+
+// emitCountedLoop emits a loop of the counted form over an i64 counter, with
+// the trip count computed up front, which the vectorizer needs. The loop
+// variable then takes exactly the values the loop as written would give it
+// when the start is a whole number and both ends are small enough for every
+// value to be exact; otherwise, the loop as written runs instead. That
+// fallback is only emitted when the ends aren't both constants.
+Value *ForExprAST::emitCountedLoop(Value *StartVal, Value *Init, ExprAST &Bound,
+                                   uint64_t StepN) {
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    Type *NumTy = numTy();
+    Type *BitsTy = Builder->getIntNTy(NumTy->getPrimitiveSizeInBits());
+    Type *Int64Ty = Type::getInt64Ty(*TheContext);
+    Value *BoundV = Bound.codegen();
+    if (!BoundV)
+        return nullptr;
+
+    // The start must convert to an integer and back to the same bits, which
+    // also rules out -0.0. NaNs fail the range checks, and the select keeps
+    // the conversion of a value out of range from mattering.
+    double LimitVal = CurPrecision == Precision::F32 ? 0x1p24 : 0x1p52;
+    auto *StartC = dyn_cast<ConstantFP>(StartVal);
+    auto *BoundC = dyn_cast<ConstantFP>(BoundV);
+    // With both ends constant, the check is made now instead.
+    if (StartC && BoundC) {
+        double S = StartC->getValueAPF().convertToDouble();
+        double B = BoundC->getValueAPF().convertToDouble();
+        if (!(std::fabs(S) <= LimitVal && std::fabs(B) <= LimitVal) ||
+            (double)(int64_t)S != S || (S == 0 && std::signbit(S)))
+            return emitLoop(StartVal, Init);
+    }
+    Value *First = Builder->CreateFPToSI(StartVal, Int64Ty, "first");
+    BasicBlock *CountedBB = BasicBlock::Create(*TheContext, "counted", TheFunction);
+    Value *GenericAcc = nullptr;
+    BasicBlock *GenericEnd = nullptr;
+    if (StartC && BoundC) {
+        Builder->CreateBr(CountedBB);
     } else {
-        NamedValues.erase(VarName);
+        Value *Limit = ConstantFP::get(NumTy, LimitVal);
+        Value *InRange = Builder->CreateAnd(
+            Builder->CreateFCmpOLE(Builder->CreateUnaryIntrinsic(Intrinsic::fabs, StartVal),
+                                   Limit),
+            Builder->CreateFCmpOLE(Builder->CreateUnaryIntrinsic(Intrinsic::fabs, BoundV),
+                                   Limit));
+        Value *Exact = Builder->CreateICmpEQ(
+            Builder->CreateBitCast(Builder->CreateSIToFP(First, NumTy), BitsTy),
+            Builder->CreateBitCast(StartVal, BitsTy));
+        Value *Counted = Builder->CreateSelect(InRange, Exact, Builder->getFalse(), "counted");
+        BasicBlock *GenericBB = BasicBlock::Create(*TheContext, "generic", TheFunction);
+        Builder->CreateCondBr(Counted, CountedBB, GenericBB);
+
+        Builder->SetInsertPoint(GenericBB);
+        bool WasInFallback = InCountedFallback;
+        InCountedFallback = true;
+        GenericAcc = emitLoop(StartVal, Init);
+        InCountedFallback = WasInFallback;
+        if (!GenericAcc)
+            return nullptr;
+        GenericEnd = Builder->GetInsertBlock();
     }
-    TheFunction->insert(TheFunction->end(), AfterBB);
 
-    auto resp = Constant::getNullValue(Type::getDoubleTy(*TheContext));
-    return resp;
+    // The loop variable takes the whole values First + K * StepN below
+    // ceil(Bound), K counting from 0.
+    Builder->SetInsertPoint(CountedBB);
+    Value *Last = Builder->CreateFPToSI(Builder->CreateUnaryIntrinsic(Intrinsic::ceil, BoundV),
+                                        Int64Ty, "last");
+    Value *Span = Builder->CreateNSWSub(Last, First, "span");
+    Value *Trips = Builder->CreateSelect(
+        Builder->CreateICmpSGT(Span, Builder->getInt64(0)),
+        Builder->CreateSDiv(Builder->CreateNSWAdd(Span, Builder->getInt64(StepN - 1)),
+                            Builder->getInt64(StepN)),
+        Builder->getInt64(0), "trips");
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "countedloop", TheFunction);
+    BasicBlock *ExitBB = BasicBlock::Create(*TheContext, "countedexit");
+    Builder->CreateCondBr(Builder->CreateICmpSGT(Trips, Builder->getInt64(0)), LoopBB, ExitBB);
+
+    Builder->SetInsertPoint(LoopBB);
+    PHINode *K = Builder->CreatePHI(Int64Ty, 2, "k");
+    K->addIncoming(Builder->getInt64(0), CountedBB);
+    PHINode *Acc = Builder->CreatePHI(NumTy, 2, "acc");
+    Acc->addIncoming(Init, CountedBB);
+    NamedValues[VarName] = Builder->CreateSIToFP(
+        Builder->CreateNSWAdd(First, Builder->CreateNSWMul(K, Builder->getInt64(StepN))),
+        NumTy, VarName);
+    Value *BodyV = Body->codegen();
+    if (!BodyV)
+        return nullptr;
+    Value *AccNext = emitReduce(Kind, Acc, BodyV);
+    Value *KNext = Builder->CreateNSWAdd(K, Builder->getInt64(1), "knext");
+    BasicBlock *LatchBB = Builder->GetInsertBlock();
+    K->addIncoming(KNext, LatchBB);
+    Acc->addIncoming(AccNext, LatchBB);
+    Builder->CreateCondBr(Builder->CreateICmpSLT(KNext, Trips), LoopBB, ExitBB);
+
+    TheFunction->insert(TheFunction->end(), ExitBB);
+    Builder->SetInsertPoint(ExitBB);
+    PHINode *CountedAcc = Builder->CreatePHI(NumTy, 2, "countedacc");
+    CountedAcc->addIncoming(Init, CountedBB);
+    CountedAcc->addIncoming(AccNext, LatchBB);
+    if (!GenericAcc)
+        return CountedAcc;
+
+    BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "loopmerge", TheFunction);
+    Builder->CreateBr(MergeBB);
+    Builder->SetInsertPoint(GenericEnd);
+    Builder->CreateBr(MergeBB);
+    Builder->SetInsertPoint(MergeBB);
+    PHINode *Result = Builder->CreatePHI(NumTy, 2, "reduction");
+    Result->addIncoming(GenericAcc, GenericEnd);
+    Result->addIncoming(CountedAcc, ExitBB);
+    return Result;
 }
 
 void InitializeJIT() {
@@ -276,6 +651,13 @@ void InitializeJIT() {
     InitializeNativeTargetAsmParser();
 
     TheJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create());
+    loadVectorMathLibrary();
+    initStats();
+}
+
+orc::ThreadSafeModule takeModule() {
+    trackModule(*TheModule);
+    return orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
 }
 
 void InitializeModule() {
@@ -283,9 +665,11 @@ void InitializeModule() {
     TheContext = std::make_unique<LLVMContext>();
     TheModule = std::make_unique<Module>("my cool jit", *TheContext);
     TheModule->setDataLayout(TheJIT->getDataLayout());
+    TheModule->setTargetTriple(TheJIT->getTargetMachine().getTargetTriple().str());
 
     // Create a new builder for the module.
     Builder = std::make_unique<IRBuilder<>>(*TheContext);
+    initDebugInfo();
 
     TheFPM = std::make_unique<FunctionPassManager>();
     TheLAM = std::make_unique<LoopAnalysisManager>();
@@ -308,10 +692,24 @@ void InitializeModule() {
     // SimplifyCFGPass is a pass that simplifies the control flow graph to improve
     // performance.
     TheFPM->addPass(SimplifyCFGPass());
+    // LICMPass hoists loop-invariant code out of loops, including calls to
+    // functions that purity.hpp found to have no effects.
+    TheFPM->addPass(createFunctionToLoopPassAdaptor(LICMPass(LICMOptions()),
+                                                    /*UseMemorySSA=*/true));
+    // LoopVectorizePass vectorizes loops with an integer induction variable,
+    // such as the batch kernels of columns.hpp, including calls to the math
+    // intrinsics when a vector math library is loaded.
+    TheFPM->addPass(LoopVectorizePass());
+    TheFPM->addPass(InstCombinePass());
 
-    PassBuilder PB;
+    // The target machine gives the vectorizer the host's vector width and
+    // costs, and the library info says which math calls have vector forms.
+    PassBuilder PB(&TheJIT->getTargetMachine());
+    registerMathLibraryInfo(*TheFAM);
     PB.registerModuleAnalyses(*TheMAM);
+    PB.registerCGSCCAnalyses(*TheCGAM);
     PB.registerFunctionAnalyses(*TheFAM);
+    PB.registerLoopAnalyses(*TheLAM);
     PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
 }
 
@@ -325,4 +723,30 @@ double putchard(double X) {
 double printd(double X) {
     printf("%f\n", X);
     return 0;
-}
\ No newline at end of file
+}
+
+void optimizeWholeProgram(Module &M, const std::string &Entry) {
+    ModulePassManager MPM;
+    // Nothing outside the module calls anything but the entry, so every
+    // other function can be changed, inlined or deleted at will.
+    MPM.addPass(InternalizePass([&](const GlobalValue &GV) { return GV.getName() == Entry; }));
+    MPM.addPass(GlobalDCEPass());
+    // Propagates constants across calls, and clones functions called with
+    // constant arguments for them.
+    MPM.addPass(IPSCCPPass(IPSCCPOptions(/*AllowFuncSpec=*/true)));
+    // Inline bottom-up, cleaning up each function before its callers decide.
+    ModuleInlinerWrapperPass Inliner(getInlineParams(/*OptLevel=*/3));
+    FunctionPassManager Cleanup;
+    Cleanup.addPass(InstCombinePass());
+    Cleanup.addPass(SimplifyCFGPass());
+    Inliner.getPM().addPass(createCGSCCToFunctionPassAdaptor(std::move(Cleanup)));
+    MPM.addPass(std::move(Inliner));
+    MPM.addPass(GlobalDCEPass());
+    MPM.run(M, *TheMAM);
+
+    // What is left gets the per-function pipeline again, now that loops can
+    // see the bodies of the functions they called.
+    for (Function &F : M)
+        if (!F.isDeclaration())
+            TheFPM->run(F, *TheFAM);
+}
@@ -20,9 +20,12 @@
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
 #include "jit.hpp"
 #include <algorithm>
 #include <cctype>
@@ -30,16 +33,67 @@
 #include <cstdlib>
 #include <map>
 #include <memory>
+#include <optional>
+#include <set>
 #include <string>
 #include <vector>
 
+class Evaluator;
+class CostEstimator;
+class PurityAnalysis;
+class NumberExprAST;
+class VariableExprAST;
+class BinaryExprAST;
+
+// SourceLocation is a position in the input, used for debug info.
+struct SourceLocation {
+    int Line;
+    int Col;
+};
+
+// CurLoc is the location of the current token, it is defined in the lexer.
+extern SourceLocation CurLoc;
+
+// Precision is the floating-point type a function computes with. Whatever
+// it is, functions take and return doubles, which is what the host, the stubs
+// and other functions call them with; an f32 function converts its arguments
+// on entry, and values on their way out or into a call.
+enum class Precision { F64, F32 };
+
+// DefaultPrecision is set by --precision, and applies to the functions and
+// top-level expressions parsed without an f32 or f64 annotation.
+extern Precision DefaultPrecision;
+
+// CountedAllocation makes the AST classes deriving from it count the bytes
+// they allocate, see stats.hpp.
+struct CountedAllocation {
+    static void *operator new(size_t Size);
+    static void operator delete(void *P, size_t Size);
+};
+
 // ExprAST is the base class for all expression AST nodes
-class ExprAST {
+class ExprAST : public CountedAllocation {
+    SourceLocation Loc;
+
 public:
+    ExprAST(SourceLocation Loc = CurLoc) : Loc(Loc) {}
+    int getLine() const { return Loc.Line; }
+    int getCol() const { return Loc.Col; }
     // Virtual destructor to ensure proper cleanup of derived class objects
     virtual ~ExprAST() = default;
     // Static single assignment (SSA) -> every variable is assigned only once
     virtual llvm::Value *codegen() = 0;
+    // Compute the value at compile time, see eval.hpp.
+    virtual std::optional<double> evaluate(Evaluator &E) = 0;
+    // Estimate the work needed to evaluate the node, see eval.hpp.
+    virtual unsigned estimateCost(CostEstimator &C) = 0;
+    // Record what the node does for the summary of its function, see purity.hpp.
+    virtual void inferPurity(PurityAnalysis &P) = 0;
+    // asNumber, asVariable and asBinary return the node as that kind of node,
+    // or nullptr.
+    virtual NumberExprAST *asNumber() { return nullptr; }
+    virtual VariableExprAST *asVariable() { return nullptr; }
+    virtual BinaryExprAST *asBinary() { return nullptr; }
 };
 
 
@@ -49,7 +103,12 @@ class NumberExprAST : public ExprAST {
 
 public:
     NumberExprAST(double Val) : Val(Val) {}
+    double getVal() const { return Val; }
     llvm::Value *codegen() override;
+    std::optional<double> evaluate(Evaluator &E) override;
+    unsigned estimateCost(CostEstimator &C) override;
+    void inferPurity(PurityAnalysis &P) override;
+    NumberExprAST *asNumber() override { return this; }
 };
 
 // Expression class for referencing a variable, like "a".
@@ -58,47 +117,119 @@ class VariableExprAST : public ExprAST {
 
 public:
     VariableExprAST(const std::string &Name) : Name(Name) {}
+    const std::string &getName() const { return Name; }
     llvm::Value *codegen() override;
+    std::optional<double> evaluate(Evaluator &E) override;
+    unsigned estimateCost(CostEstimator &C) override;
+    void inferPurity(PurityAnalysis &P) override;
+    VariableExprAST *asVariable() override { return this; }
 };
 
 // Expression class for a binary operator.
+//
+// Generated expressions can chain operators or parentheses far deeper than
+// the native stack allows, so trees of binary operators are never walked by
+// recursion: the parser builds them with explicit stacks, and codegen,
+// evaluation, cost estimation, purity inference and destruction go through
+// fold.
 class BinaryExprAST : public ExprAST {
     char Op;
     std::unique_ptr<ExprAST> LHS, RHS;
+
+    // fold computes a value for the tree of binary operators rooted here, in
+    // the order recursion would. Leaf(ExprAST &) computes the value of any
+    // other node, and Combine(BinaryExprAST &, T L, T R) that of an operator
+    // from the values of its operands. Both return std::optional<T>, and an
+    // empty one stops the walk.
+    template <typename T, typename LeafFn, typename CombineFn>
+    std::optional<T> fold(LeafFn Leaf, CombineFn Combine);
+
 public:
-    BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
+    BinaryExprAST(SourceLocation Loc, char Op, std::unique_ptr<ExprAST> LHS,
                   std::unique_ptr<ExprAST> RHS)
-        : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+        : ExprAST(Loc), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    ~BinaryExprAST() override;
+    char getOp() const { return Op; }
+    ExprAST *getLHS() const { return LHS.get(); }
+    ExprAST *getRHS() const { return RHS.get(); }
     llvm::Value *codegen() override;
+    std::optional<double> evaluate(Evaluator &E) override;
+    unsigned estimateCost(CostEstimator &C) override;
+    void inferPurity(PurityAnalysis &P) override;
+    BinaryExprAST *asBinary() override { return this; }
 };
 
+template <typename T, typename LeafFn, typename CombineFn>
+std::optional<T> BinaryExprAST::fold(LeafFn Leaf, CombineFn Combine) {
+    // Each step visits a node, or with Combine set, applies an operator to the
+    // last two values.
+    struct Step {
+        ExprAST *E;
+        bool Combine;
+    };
+    std::vector<Step> Steps{{this, false}};
+    std::vector<T> Values;
+    while (!Steps.empty()) {
+        Step S = Steps.back();
+        Steps.pop_back();
+        BinaryExprAST *B = S.E->asBinary();
+        if (S.Combine) {
+            T R = std::move(Values.back());
+            Values.pop_back();
+            std::optional<T> V = Combine(*B, std::move(Values.back()), std::move(R));
+            if (!V)
+                return std::nullopt;
+            Values.back() = std::move(*V);
+        } else if (B) {
+            // The left operand comes first, so it is pushed last.
+            Steps.push_back({B, true});
+            Steps.push_back({B->RHS.get(), false});
+            Steps.push_back({B->LHS.get(), false});
+        } else {
+            std::optional<T> V = Leaf(*S.E);
+            if (!V)
+                return std::nullopt;
+            Values.push_back(std::move(*V));
+        }
+    }
+    return std::move(Values.back());
+}
+
 // Expression class for function calls.
 class CallExprAST : public ExprAST {
     std::string Callee;
     std::vector<std::unique_ptr<ExprAST>> Args;
 public:
-    CallExprAST(const std::string &Callee,
+    CallExprAST(SourceLocation Loc, const std::string &Callee,
                 std::vector<std::unique_ptr<ExprAST>> Args)
-        : Callee(Callee), Args(std::move(Args)) {}
+        : ExprAST(Loc), Callee(Callee), Args(std::move(Args)) {}
     llvm::Value *codegen() override;
+    std::optional<double> evaluate(Evaluator &E) override;
+    unsigned estimateCost(CostEstimator &C) override;
+    void inferPurity(PurityAnalysis &P) override;
 };
 
 
 // Prototype for a function, which captures its name, and its argument names
-class PrototypeAST {
+class PrototypeAST : public CountedAllocation {
     std::string Name;
     std::vector<std::string> Args;
+    int Line;
+    Precision Prec;
 
 public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-        : Name(Name), Args(std::move(Args)) {}
+    PrototypeAST(SourceLocation Loc, const std::string &Name, std::vector<std::string> Args,
+                 Precision Prec = DefaultPrecision)
+        : Name(Name), Args(std::move(Args)), Line(Loc.Line), Prec(Prec) {}
     llvm::Function *codegen();
     const std::string &getName() const { return Name; }
+    int getLine() const { return Line; }
     std::vector<std::string> getArgs() const { return Args; }
+    Precision getPrecision() const { return Prec; }
 };
 
 // Function definition itself
-class FunctionAST {
+class FunctionAST : public CountedAllocation {
     std::unique_ptr<PrototypeAST> Proto;
     std::unique_ptr<ExprAST> Body;
 
@@ -108,28 +239,80 @@ public:
         : Proto(std::move(Proto)), Body(std::move(Body)) {}
     llvm::Function *codegen();
     PrototypeAST *getProto() const { return Proto.get(); }
+    ExprAST *getBody() const { return Body.get(); }
 };
 
 class IfExprAST: public ExprAST {
     std::unique_ptr<ExprAST> Cond, Then, Else;
 public:
-    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
-        : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+    IfExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
+        : ExprAST(Loc), Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
     llvm::Value *codegen() override;
+    std::optional<double> evaluate(Evaluator &E) override;
+    unsigned estimateCost(CostEstimator &C) override;
+    void inferPurity(PurityAnalysis &P) override;
 };
 
+// Expression class for a loop. A plain for loop evaluates to 0.0, and is only
+// run for its side effects. The reduction forms `sum`, `prod`, `min` and `max`
+// combine the values of the body instead, starting from 0, 1, +inf and -inf.
+// min and max ignore NaNs, like fmin and fmax.
 class ForExprAST: public ExprAST {
+public:
+    enum class Reduction { None, Sum, Prod, Min, Max };
+
+private:
     std::string VarName;
     std::unique_ptr<ExprAST> Start, Cond, Step, Body;
+    Reduction Kind;
+
+    bool isCounted(ExprAST *&Bound, uint64_t &StepN);
+    llvm::Value *emitLoop(llvm::Value *StartVal, llvm::Value *Init);
+    llvm::Value *emitCountedLoop(llvm::Value *StartVal, llvm::Value *Init, ExprAST &Bound,
+                                 uint64_t StepN);
+
 public:
-    ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)), Cond(std::move(Cond)), Step(std::move(Step)), Body(std::move(Body)) {}
+    ForExprAST(SourceLocation Loc, const std::string &VarName, std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body, Reduction Kind = Reduction::None)
+        : ExprAST(Loc), VarName(VarName), Start(std::move(Start)), Cond(std::move(Cond)), Step(std::move(Step)), Body(std::move(Body)), Kind(Kind) {}
     llvm::Value *codegen() override;
+    std::optional<double> evaluate(Evaluator &E) override;
+    unsigned estimateCost(CostEstimator &C) override;
+    void inferPurity(PurityAnalysis &P) override;
+
+    // identity is the value of a reduction that runs zero times, and reduce
+    // combines the value so far with the value of the body.
+    static double identity(Reduction R);
+    static double reduce(Reduction R, double Acc, double V);
 };
 
+// FastReductions is set by --fast-reductions. It lets the optimizer reorder
+// the operations of reduction loops so that they can be vectorized, like
+// -ffast-math for them: sums and products may round differently, and min and
+// max assume there are no NaNs.
+extern bool FastReductions;
+
+// CurPrecision is the precision of the code being generated. numTy is its
+// type, and toNum and toDouble convert values of the ABI to it and back.
+extern Precision CurPrecision;
+llvm::Type *numTy();
+llvm::Value *toNum(llvm::Value *V);
+llvm::Value *toDouble(llvm::Value *V);
+
 void InitializeModule();
 void InitializeJIT();
 
+// takeModule hands TheModule and TheContext over, ready to be added to the
+// JIT. InitializeModule must be called before generating more code.
+llvm::orc::ThreadSafeModule takeModule();
+
+// optimizeWholeProgram optimizes M as a closed program whose only entry point
+// is the function Entry, see WholeProgram in parser.hpp.
+void optimizeWholeProgram(llvm::Module &M, const std::string &Entry);
+
+// getFunction returns the declaration of Name in the current module, emitting
+// it from FunctionProtos if the function was defined in an earlier module.
+llvm::Function *getFunction(const std::string &Name);
+
 // LLVMContext is necessary for managing the LLVM context
 extern std::unique_ptr<llvm::LLVMContext> TheContext;
 
@@ -157,13 +340,34 @@ extern std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
 extern std::unique_ptr<llvm::StandardInstrumentations> TheSI;
 extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
 
+// FunctionDefs keeps the AST of the current definition of every function, so
+// that calls to it can be evaluated or specialized at compile time.
+extern std::map<std::string, std::unique_ptr<FunctionAST>> FunctionDefs;
+
+// HostFunctions holds the names the host registered through
+// Engine::registerExtern. They can't be given a body.
+extern std::set<std::string> HostFunctions;
+
+// ImportedFunctions holds the names defined by imported precompiled modules.
+// Like host functions, they shadow the math library.
+extern std::set<std::string> ImportedFunctions;
+
 extern llvm::ExitOnError ExitOnErr;
 
 extern bool EXIT_ON_ERROR;
 
 
+// Diagnostics, when set, receives errors instead of stderr, and errors no
+// longer exit. The pipelined file mode uses it to report errors in input
+// order; it then stops by itself when it reaches one.
+extern thread_local llvm::raw_ostream *Diagnostics;
+
 /// LogError* - These are little helper functions for error handling.
 inline std::unique_ptr<ExprAST> LogError(const char *Str) {
+  if (Diagnostics) {
+    *Diagnostics << "Error: " << Str << "\n";
+    return nullptr;
+  }
   fprintf(stderr, "Error: %s\n", Str);
   // if exit on error is enabled, exit the program
   if (EXIT_ON_ERROR) {
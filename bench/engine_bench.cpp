@@ -0,0 +1,43 @@
+// engine_bench.cpp - cost of calling a compiled function from host code,
+// against the same formula compiled by the C++ compiler.
+#include "engine.hpp"
+#include <chrono>
+#include <cstdio>
+
+static const long Calls = 100000000;
+
+static double formula(double X, double Y) { return X * Y + X / 2 - Y; }
+
+static double scale(double X) { return X * 0.5; }
+
+// time runs F over Calls inputs and prints the time per call. The pointer is
+// volatile so that the C function can't be inlined into the loop.
+static void time(const char *Name, double (*volatile F)(double, double)) {
+    auto Start = std::chrono::steady_clock::now();
+    double Sum = 0;
+    for (long I = 0; I < Calls; I++)
+        Sum += F(I, 3);
+    std::chrono::duration<double, std::nano> Took = std::chrono::steady_clock::now() - Start;
+    printf("%-24s %.3f ns/call (sum %g)\n", Name, Took.count() / Calls, Sum);
+}
+
+int main() {
+    Engine E;
+    if (!E.registerExtern("scale", scale) ||
+        !E.compile("def formula(x y) x*y + x/2 - y;"
+                   "def scaled(x y) scale(x*y) + x/2 - y;")) {
+        fprintf(stderr, "%s", E.getError().c_str());
+        return 1;
+    }
+    auto Formula = E.lookup<double, double>("formula");
+    auto Scaled = E.lookup<double, double>("scaled");
+
+    time("C function pointer", formula);
+    time("Kaleidoscope function", Formula);
+    time("with a host callback", Scaled);
+
+    // The handle follows the new body.
+    E.compile("def formula(x y) x - y;");
+    printf("formula(5, 3) after redefinition: %g\n", Formula(5, 3));
+    return 0;
+}
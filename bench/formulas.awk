@@ -0,0 +1,17 @@
+# Generates a library of formulas and a few queries against it.
+# part=lib prints the definitions, part=source prints the definitions
+# followed by the queries, and part=import imports the precompiled
+# library before the queries.
+BEGIN {
+    n = 3000
+    if (part == "import")
+        print "import formulas;"
+    if (part == "lib" || part == "source") {
+        print "def poly0(x) x*x + 1;"
+        for (i = 1; i < n; i++)
+            printf "def poly%d(x) if x < %d then poly%d(x)*x + %d else x*(x - %d)/%d;\n", i, i, i - 1, i, i, i + 1
+    }
+    if (part == "import" || part == "source")
+        for (i = 0; i < n; i += 100)
+            printf "poly%d(%d) + poly%d(0.5);\n", i, i % 7, n - 1 - i
+}
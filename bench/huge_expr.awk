@@ -0,0 +1,26 @@
+# Generates a single huge expression for make bench, n terms long:
+# kind=flat is a long sum of products, kind=deep nests every term in its own
+# parentheses, and kind=body makes it the body of a function and calls it.
+BEGIN {
+    if (kind == "body")
+        printf "def poly(x) x"
+    else if (kind == "deep") {
+        for (i = 0; i < n; i++)
+            printf "("
+        printf "1"
+    } else
+        printf "1"
+    for (i = 1; i < n; i++) {
+        if (kind == "body")
+            printf " + x*%d", i % 10
+        else if (kind == "deep")
+            printf " + %d)", i % 10
+        else
+            printf " + %d*%d", i % 10, i % 7
+    }
+    if (kind == "deep")
+        printf ")"
+    print ";"
+    if (kind == "body")
+        print "poly(2);"
+}
@@ -0,0 +1,75 @@
+// lex_bench.cpp - lexer throughput on a large generated script, with each
+// scanner implementation the CPU can run, see scan.hpp.
+#include "lexer.hpp"
+#include "scan.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+// makeSource writes a script like the generated benchmarks: definitions with
+// long names, indented bodies, comments and numbers.
+static std::string makeSource(size_t Bytes) {
+    std::string S;
+    char Line[256];
+    for (int I = 0; S.size() < Bytes; I++) {
+        snprintf(Line, sizeof(Line),
+                 "# polynomial_coefficient_%d evaluated with Horner's rule\n"
+                 "def polynomial_coefficient_%d(argument_value scale_factor)\n"
+                 "        if argument_value < %d.25 then argument_value*scale_factor + %d.5\n"
+                 "        else (argument_value - %d)/%d.125;\n\n",
+                 I, I, I, I, I, I + 1);
+        S += Line;
+    }
+    return S;
+}
+
+// hashTokens runs the lexer over Source and returns a hash of the tokens,
+// their locations and values.
+static uint64_t hashTokens(const std::string &Source) {
+    readString(Source);
+    uint64_t Hash = 1469598103934665603ull;
+    auto Mix = [&](uint64_t V) { Hash = (Hash ^ V) * 1099511628211ull; };
+    while (true) {
+        int Tok = gettokn();
+        Mix(Tok);
+        Mix(CurLoc.Line);
+        Mix(CurLoc.Col);
+        if (Tok == tok_identifier)
+            for (char C : IdentifierStr)
+                Mix(C);
+        if (Tok == tok_number) {
+            uint64_t Bits;
+            memcpy(&Bits, &NumVal, sizeof(Bits));
+            Mix(Bits);
+        }
+        if (Tok == tok_eof)
+            return Hash;
+    }
+}
+
+int main() {
+    std::string Source = makeSource(256 << 20);
+    uint64_t Expected = 0;
+    for (const char *Name : {"scalar", "sse2", "avx2"}) {
+        if (!setScanners(Name)) {
+            printf("%-8s not supported\n", Name);
+            continue;
+        }
+        readString(Source);
+        long Tokens = 0;
+        auto Start = std::chrono::steady_clock::now();
+        while (gettokn() != tok_eof)
+            Tokens++;
+        std::chrono::duration<double> Took = std::chrono::steady_clock::now() - Start;
+        printf("%-8s %.3f GB/s (%ld tokens)\n", Name, Source.size() / Took.count() / 1e9, Tokens);
+
+        uint64_t Hash = hashTokens(Source);
+        if (!Expected)
+            Expected = Hash;
+        if (Hash != Expected) {
+            fprintf(stderr, "%s: tokens differ from the scalar lexer\n", Name);
+            return 1;
+        }
+    }
+    return 0;
+}
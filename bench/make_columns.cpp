@@ -0,0 +1,32 @@
+// make_columns.cpp - writes an input file for --map: COLS columns of ROWS
+// doubles in [0, 1).
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s OUT COLS ROWS\n", argv[0]);
+        return 1;
+    }
+    FILE *Out = fopen(argv[1], "wb");
+    if (!Out) {
+        perror(argv[1]);
+        return 1;
+    }
+    long Cols = atol(argv[2]), Rows = atol(argv[3]);
+    std::vector<double> Column(Rows);
+    uint64_t State = 88172645463325252ull;
+    for (long C = 0; C < Cols; C++) {
+        for (auto &V : Column) {
+            // xorshift64, the top 53 bits make the fraction.
+            State ^= State << 13;
+            State ^= State >> 7;
+            State ^= State << 17;
+            V = (State >> 11) * 0x1.0p-53;
+        }
+        fwrite(Column.data(), sizeof(double), Rows, Out);
+    }
+    return fclose(Out) == 0 ? 0 : 1;
+}
@@ -0,0 +1,10 @@
+# Generates a script with many definitions, each followed by top-level
+# expressions that loop, so that every item has to be JIT-compiled.
+BEGIN {
+    print "extern printd(x);"
+    for (i = 0; i < 2000; i++) {
+        printf "def f%d(x) if x < %d then x*%d + 1 else x/%d;\n", i, i, i + 1, i + 1
+        printf "for i = 0, i < 3, 1 in printd(f%d(i));\n", i
+        printf "for i = 0, i < 2, 1 in printd(f%d(i) + f%d(i+1));\n", i, i
+    }
+}
@@ -0,0 +1,9 @@
+# Generates a script with a few definitions followed by thousands of
+# top-level expressions that loop, so that every one has to be JIT-compiled.
+BEGIN {
+    print "extern printd(x);"
+    print "def scale(x k) x*k;"
+    print "def lerp(a b t) a + (b-a)*t;"
+    for (i = 0; i < 5000; i++)
+        printf "for i = 0, i < 2, 1 in printd(lerp(%d, scale(i, %d), 0.25));\n", i, i + 1
+}
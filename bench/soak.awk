@@ -0,0 +1,17 @@
+# Generates n top-level items for make soak: mostly expressions answered at
+# compile time or interpreted, every 100th a loop that is JIT-compiled and
+# freed, and every 1000th a redefinition that replaces a compiled body.
+BEGIN {
+    print "def step(x) x*2 + 1;"
+    for (i = 1; i < n; i++) {
+        if (i % 1000 == 0)
+            printf "def step(x) x*%d + 1;\n", i % 7 + 2
+        else if (i % 100 == 0)
+            printf "for j = 0, j < 3, 1 in step(j + %d);\n", i
+        else if (i % 2 == 0)
+            printf "step(%d) + %d;\n", i % 50, i
+        else
+            printf "if %d < 5 then step(1) else step(2);\n", i % 10
+    }
+    print ":stats"
+}
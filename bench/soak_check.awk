@@ -0,0 +1,30 @@
+# Compares the --stats dumps of a short and a long soak run, given in that
+# order, and fails if memory grew with the number of items.
+{
+    if (FNR == 1)
+        run++
+    if (match($0, /"[a-z_]+": -?[0-9]+/)) {
+        split(substr($0, RSTART, RLENGTH), kv, /": /)
+        stat[run, substr(kv[1], 2)] = kv[2] + 0
+    }
+}
+function bounded(name, slack) {
+    if (stat[2, name] > stat[1, name] + slack) {
+        printf "soak: %s grew from %d to %d\n", name, stat[1, name], stat[2, name]
+        failed = 1
+    }
+}
+END {
+    bounded("ast_bytes", 4096)
+    bounded("ir_bytes", 4096)
+    bounded("live_modules", 0)
+    bounded("jit_objects", 0)
+    bounded("jit_code_bytes", 4096)
+    bounded("jit_data_bytes", 4096)
+    bounded("function_protos", 0)
+    # The allocator may hold on to some more pages in a longer run.
+    bounded("peak_rss_kib", stat[1, "peak_rss_kib"] / 4 + 8192)
+    if (failed)
+        exit 1
+    printf "soak: memory stayed bounded over %d items\n", stat[2, "expressions_evaluated"] + stat[2, "expressions_interpreted"] + stat[2, "expressions_compiled"] + stat[2, "definitions_compiled"]
+}
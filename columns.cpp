@@ -0,0 +1,211 @@
+// columns.cpp
+#include "columns.hpp"
+#include "debuginfo.hpp"
+#include "profile.hpp"
+#include "llvm/Support/FileSystem.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace llvm;
+
+std::string MapFunctionName;
+std::string MapInputPath;
+std::string MapOutputPath;
+unsigned MapThreads = 0;
+bool MapPerRow = false;
+
+// Rows handed to a thread at a time, small enough to balance the load and
+// large enough that taking a chunk costs nothing.
+static const uint64_t ChunkRows = 1 << 16;
+
+// A batch kernel computes Out[Row] for every Row in [Begin, End), reading
+// the I-th argument from Cols[I][Row].
+using BatchKernel = void (*)(const double *const *Cols, double *Out, uint64_t Begin, uint64_t End);
+
+// emitBatchKernel emits Name.batch into the current module. With Def, the
+// body of the function is generated inside the loop; without, the loop calls
+// the function.
+static Function *emitBatchKernel(const PrototypeAST &Proto, FunctionAST *Def) {
+    const auto &Params = Proto.getArgs();
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    Type *PtrTy = PointerType::getUnqual(*TheContext);
+    Type *IndexTy = Type::getInt64Ty(*TheContext);
+    FunctionType *FT =
+        FunctionType::get(Type::getVoidTy(*TheContext), {PtrTy, PtrTy, IndexTy, IndexTy}, false);
+    Function *F =
+        Function::Create(FT, Function::ExternalLinkage, Proto.getName() + ".batch", TheModule.get());
+    // The output never overlaps the columns, which lets the loop vectorize
+    // without runtime checks.
+    F->addParamAttr(1, Attribute::NoAlias);
+    auto AI = F->arg_begin();
+    Value *Cols = &*AI++;
+    Value *Out = &*AI++;
+    Value *Begin = &*AI++;
+    Value *End = &*AI;
+
+    BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", F);
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "row", F);
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "done");
+    Builder->SetInsertPoint(EntryBB);
+    beginFunctionDebugInfo(F, Proto);
+    emitLocation(nullptr);
+
+    // The column pointers don't change from row to row.
+    std::vector<Value *> ColPtrs;
+    for (unsigned i = 0, e = Params.size(); i != e; ++i)
+        ColPtrs.push_back(Builder->CreateLoad(
+            PtrTy, Builder->CreateConstInBoundsGEP1_64(PtrTy, Cols, i), Params[i] + ".col"));
+    Builder->CreateCondBr(Builder->CreateICmpULT(Begin, End), LoopBB, AfterBB);
+
+    Builder->SetInsertPoint(LoopBB);
+    PHINode *Row = Builder->CreatePHI(IndexTy, 2, "row");
+    Row->addIncoming(Begin, EntryBB);
+    NamedValues.clear();
+    std::vector<Value *> ArgsV;
+    for (unsigned i = 0, e = Params.size(); i != e; ++i) {
+        Value *V = Builder->CreateLoad(DoubleTy, Builder->CreateInBoundsGEP(DoubleTy, ColPtrs[i], Row),
+                                       Params[i]);
+        ArgsV.push_back(V);
+    }
+
+    Value *Result;
+    if (Def) {
+        // The body computes at its own precision, between the columns.
+        CurPrecision = Proto.getPrecision();
+        for (unsigned i = 0, e = Params.size(); i != e; ++i)
+            NamedValues[Params[i]] = toNum(ArgsV[i]);
+        emitLocation(Def->getBody());
+        // The ifs of the body count and take their weights as the function's.
+        beginProfiledFunction(Proto.getName());
+        Result = Def->getBody()->codegen();
+        if (Result) {
+            Result = toDouble(Result);
+            commitProfiledFunction();
+        }
+    } else {
+        Result = Builder->CreateCall(getFunction(Proto.getName()), ArgsV, "calltmp");
+    }
+    endFunctionDebugInfo();
+    if (!Result) {
+        F->eraseFromParent();
+        return nullptr;
+    }
+
+    Builder->CreateStore(Result, Builder->CreateInBoundsGEP(DoubleTy, Out, Row));
+    Value *NextRow = Builder->CreateAdd(Row, ConstantInt::get(IndexTy, 1), "nextrow");
+    // The body may have added blocks, the loop continues from the last one.
+    Row->addIncoming(NextRow, Builder->GetInsertBlock());
+    Builder->CreateCondBr(Builder->CreateICmpULT(NextRow, End), LoopBB, AfterBB);
+
+    F->insert(F->end(), AfterBB);
+    Builder->SetInsertPoint(AfterBB);
+    Builder->CreateRetVoid();
+    verifyFunction(*F);
+    TheFPM->run(*F, *TheFAM);
+    return F;
+}
+
+bool mapColumns() {
+    auto PI = FunctionProtos.find(MapFunctionName);
+    if (PI == FunctionProtos.end()) {
+        fprintf(stderr, "Error: Unknown function %s\n", MapFunctionName.c_str());
+        return false;
+    }
+    const PrototypeAST &Proto = *PI->second;
+    size_t NumCols = Proto.getArgs().size();
+    if (NumCols == 0) {
+        fprintf(stderr, "Error: %s takes no arguments, there are no columns to map\n",
+                MapFunctionName.c_str());
+        return false;
+    }
+
+    // Functions imported from a module or the host can only be called.
+    auto DI = FunctionDefs.find(MapFunctionName);
+    FunctionAST *Def = MapPerRow || DI == FunctionDefs.end() ? nullptr : DI->second.get();
+    if (!emitBatchKernel(Proto, Def))
+        return false;
+    finalizeDebugInfo();
+    ExitOnErr(TheJIT->addModule(takeModule()));
+    InitializeModule();
+    auto Kernel =
+        ExitOnErr(TheJIT->lookup(MapFunctionName + ".batch")).getAddress().toPtr<BatchKernel>();
+
+    int InFD;
+    if (auto EC = sys::fs::openFileForRead(MapInputPath, InFD)) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", MapInputPath.c_str(), EC.message().c_str());
+        return false;
+    }
+    sys::fs::file_status Status;
+    if (auto EC = sys::fs::status(InFD, Status)) {
+        fprintf(stderr, "Error: Cannot read %s: %s\n", MapInputPath.c_str(), EC.message().c_str());
+        sys::fs::closeFile(InFD);
+        return false;
+    }
+    uint64_t InSize = Status.getSize();
+    if (InSize % (NumCols * sizeof(double)) != 0) {
+        fprintf(stderr, "Error: %s does not hold %zu columns of doubles\n", MapInputPath.c_str(),
+                NumCols);
+        sys::fs::closeFile(InFD);
+        return false;
+    }
+    uint64_t Rows = InSize / (NumCols * sizeof(double));
+    uint64_t OutSize = Rows * sizeof(double);
+
+    int OutFD;
+    if (auto EC = sys::fs::openFileForReadWrite(MapOutputPath, OutFD, sys::fs::CD_CreateAlways,
+                                                sys::fs::OF_None)) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", MapOutputPath.c_str(), EC.message().c_str());
+        sys::fs::closeFile(InFD);
+        return false;
+    }
+    std::error_code EC = sys::fs::resize_file(OutFD, OutSize);
+
+    // Empty files can't be mapped, and there is nothing to do for them.
+    std::unique_ptr<sys::fs::mapped_file_region> In, Out;
+    if (!EC && Rows > 0) {
+        In = std::make_unique<sys::fs::mapped_file_region>(
+            sys::fs::convertFDToNativeFile(InFD), sys::fs::mapped_file_region::readonly, InSize, 0,
+            EC);
+        if (!EC)
+            Out = std::make_unique<sys::fs::mapped_file_region>(
+                sys::fs::convertFDToNativeFile(OutFD), sys::fs::mapped_file_region::readwrite,
+                OutSize, 0, EC);
+    }
+    // The mappings stay valid without the descriptors.
+    sys::fs::closeFile(InFD);
+    sys::fs::closeFile(OutFD);
+    if (EC) {
+        fprintf(stderr, "Error: Cannot map %s or %s: %s\n", MapInputPath.c_str(),
+                MapOutputPath.c_str(), EC.message().c_str());
+        return false;
+    }
+
+    std::vector<const double *> Cols;
+    for (size_t i = 0; i < NumCols; i++)
+        Cols.push_back(In ? reinterpret_cast<const double *>(In->const_data()) + i * Rows : nullptr);
+    double *Results = Out ? reinterpret_cast<double *>(Out->data()) : nullptr;
+
+    unsigned NumThreads = MapThreads ? MapThreads : std::max(1u, std::thread::hardware_concurrency());
+    uint64_t NumChunks = (Rows + ChunkRows - 1) / ChunkRows;
+    NumThreads = std::max<uint64_t>(1, std::min<uint64_t>(NumThreads, NumChunks));
+
+    auto Start = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> NextChunk{0};
+    auto Work = [&] {
+        for (uint64_t C; (C = NextChunk++) < NumChunks;)
+            Kernel(Cols.data(), Results, C * ChunkRows, std::min(Rows, (C + 1) * ChunkRows));
+    };
+    std::vector<std::thread> Threads;
+    for (unsigned i = 1; i < NumThreads; i++)
+        Threads.emplace_back(Work);
+    Work();
+    for (auto &T : Threads)
+        T.join();
+    std::chrono::duration<double> Took = std::chrono::steady_clock::now() - Start;
+
+    fprintf(stderr, "Mapped %llu rows in %.3f s on %u threads: %.1f million rows/s (%s)\n",
+            (unsigned long long)Rows, Took.count(), NumThreads,
+            Took.count() > 0 ? Rows / Took.count() / 1e6 : 0.0, Def ? "batch kernel" : "per-row calls");
+    return true;
+}
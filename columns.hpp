@@ -0,0 +1,34 @@
+// columns.hpp
+#ifndef COLUMNS_HPP
+#define COLUMNS_HPP
+
+#include "ast.hpp"
+
+// Column mode applies one function to every row of a binary input file and
+// writes one double per row to the output file. The input holds one column
+// of native-endian doubles per parameter of the function, one after the
+// other, each as long as the number of rows.
+//
+// The work is done by a batch kernel, generated for the function, that takes
+// a range of rows. By default the kernel contains the body of the function,
+// so that no call is made per row. The rows are split into chunks that the
+// threads take in turn, and both files are memory-mapped.
+
+// MapFunctionName, MapInputPath and MapOutputPath are set by --map, --in and
+// --out.
+extern std::string MapFunctionName;
+extern std::string MapInputPath;
+extern std::string MapOutputPath;
+
+// MapThreads is the number of threads to use, 0 means one per core.
+extern unsigned MapThreads;
+
+// MapPerRow makes the kernel call the compiled function for each row instead
+// of containing its body.
+extern bool MapPerRow;
+
+// mapColumns runs the function over the input, once the definitions it needs
+// are compiled, and reports the throughput.
+bool mapColumns();
+
+#endif // COLUMNS_HPP
@@ -0,0 +1,76 @@
+#include "debuginfo.hpp"
+#include "lexer.hpp"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/Support/Path.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/TargetParser/Triple.h"
+
+using namespace llvm;
+
+bool EmitDebugInfo = false;
+
+static std::unique_ptr<DIBuilder> DBuilder;
+static DICompileUnit *TheCU = nullptr;
+static DIType *DblTy = nullptr;
+
+// Scopes of the functions being generated, innermost last. Specialized clones
+// are generated in the middle of their caller, so this can be deeper than one.
+static std::vector<DIScope *> LexicalBlocks;
+
+void initDebugInfo() {
+    DBuilder.reset();
+    if (!EmitDebugInfo)
+        return;
+
+    TheModule->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+    // Darwin only supports dwarf2.
+    if (Triple(sys::getProcessTriple()).isOSDarwin())
+        TheModule->addModuleFlag(Module::Warning, "Dwarf Version", 2);
+
+    DBuilder = std::make_unique<DIBuilder>(*TheModule);
+    StringRef Dir = sys::path::parent_path(SourceFileName);
+    TheCU = DBuilder->createCompileUnit(
+        dwarf::DW_LANG_C, DBuilder->createFile(sys::path::filename(SourceFileName),
+                                               Dir.empty() ? "." : Dir),
+        "Kaleidoscope Compiler", /*isOptimized=*/true, "", 0);
+    DblTy = DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+    LexicalBlocks.clear();
+}
+
+void finalizeDebugInfo() {
+    if (DBuilder)
+        DBuilder->finalize();
+}
+
+// Every value is a double, so a function type only depends on its arity.
+static DISubroutineType *createFunctionType(unsigned NumArgs) {
+    SmallVector<Metadata *, 8> EltTys(NumArgs + 1, DblTy);
+    return DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(EltTys));
+}
+
+void beginFunctionDebugInfo(Function *F, const PrototypeAST &P) {
+    if (!DBuilder)
+        return;
+    DIFile *Unit = TheCU->getFile();
+    unsigned LineNo = P.getLine();
+    DISubprogram *SP = DBuilder->createFunction(
+        Unit, P.getName(), StringRef(), Unit, LineNo, createFunctionType(F->arg_size()), LineNo,
+        DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+    F->setSubprogram(SP);
+    LexicalBlocks.push_back(SP);
+}
+
+void endFunctionDebugInfo() {
+    if (DBuilder)
+        LexicalBlocks.pop_back();
+}
+
+void emitLocation(ExprAST *E) {
+    if (!DBuilder)
+        return;
+    if (!E || LexicalBlocks.empty())
+        return Builder->SetCurrentDebugLocation(DebugLoc());
+    DIScope *Scope = LexicalBlocks.back();
+    Builder->SetCurrentDebugLocation(
+        DILocation::get(Scope->getContext(), E->getLine(), E->getCol(), Scope));
+}
@@ -0,0 +1,27 @@
+// debuginfo.hpp
+#ifndef DEBUGINFO_HPP
+#define DEBUGINFO_HPP
+
+#include "ast.hpp"
+
+// EmitDebugInfo is set by -g. Generated functions then carry DWARF line
+// tables built from the lexer positions, which debuggers and perf's jitdump
+// support use to map machine code back to the source.
+extern bool EmitDebugInfo;
+
+// initDebugInfo sets up the debug info builder for a fresh TheModule.
+void initDebugInfo();
+
+// finalizeDebugInfo must be called before TheModule is handed to the JIT.
+void finalizeDebugInfo();
+
+// beginFunctionDebugInfo attaches a subprogram to F and makes it the scope of
+// the locations emitted until the matching endFunctionDebugInfo.
+void beginFunctionDebugInfo(llvm::Function *F, const PrototypeAST &P);
+void endFunctionDebugInfo();
+
+// emitLocation gives the instructions generated next the location of E, or no
+// location at all if E is null.
+void emitLocation(ExprAST *E);
+
+#endif // DEBUGINFO_HPP
@@ -0,0 +1,62 @@
+// engine.cpp
+#include "engine.hpp"
+#include "ast.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+
+Engine::Engine() {
+    if (TheJIT)
+        return;
+    InitializeJIT();
+    InitializeModule();
+}
+
+bool Engine::compile(const std::string &Source) {
+    Error.clear();
+    readString(Source);
+    bool Ok;
+    {
+        // Errors go to Error instead of stderr, and never exit the host.
+        llvm::raw_string_ostream Errors(Error);
+        Diagnostics = &Errors;
+        Ok = CompileDefinitions(llvm::nulls());
+        Diagnostics = nullptr;
+    }
+    // Drop what is left of the failed item, so that the next call starts
+    // with an empty module.
+    if (!Ok)
+        InitializeModule();
+    return Ok;
+}
+
+void *Engine::lookupAddress(const std::string &Name, size_t Arity) {
+    auto Proto = FunctionProtos.find(Name);
+    if (Proto == FunctionProtos.end() || Proto->second->getArgs().size() != Arity) {
+        Error = "No function " + Name + " taking " + std::to_string(Arity) + " arguments";
+        return nullptr;
+    }
+    // Defined functions resolve to their stub, which follows redefinitions.
+    auto Sym = TheJIT->lookup(Name);
+    if (!Sym) {
+        Error = llvm::toString(Sym.takeError());
+        return nullptr;
+    }
+    return Sym->getAddress().toPtr<void *>();
+}
+
+bool Engine::addHostFunction(const std::string &Name, size_t Arity, void *Fn) {
+    if (FunctionProtos.count(Name)) {
+        Error = "Function already declared: " + Name;
+        return false;
+    }
+    if (auto Err = TheJIT->addHostFunction(Name, llvm::orc::ExecutorAddr::fromPtr(Fn))) {
+        Error = llvm::toString(std::move(Err));
+        return false;
+    }
+    std::vector<std::string> Args;
+    for (size_t I = 0; I < Arity; ++I)
+        Args.push_back("x" + std::to_string(I));
+    FunctionProtos[Name] = std::make_unique<PrototypeAST>(SourceLocation{0, 0}, Name, std::move(Args));
+    HostFunctions.insert(Name);
+    return true;
+}
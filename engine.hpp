@@ -0,0 +1,59 @@
+// engine.hpp
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+
+// Engine is the entry point for programs that embed the compiler, linked
+// from libkaleidoscope.a. It compiles source text once and hands out native
+// function pointers that can then be called like any C function:
+//
+//   Engine E;
+//   E.compile("def f(x y) x*y + 1;");
+//   double (*F)(double, double) = E.lookup<double, double>("f");
+//
+// The compiler state is global, so there is one Engine per process, and
+// compile, lookup and registerExtern must not run concurrently. The returned
+// functions may be called from any thread, but not while compile redefines a
+// function: that frees the old body, which a running call may still be in.
+class Engine {
+public:
+    Engine();
+    Engine(const Engine &) = delete;
+    Engine &operator=(const Engine &) = delete;
+
+    // compile adds the definitions, externs and imports in Source; top-level
+    // expressions are rejected. Redefining a function swaps its body for
+    // every caller, including pointers returned by lookup earlier, so those
+    // stay valid. On error it returns false and getError says why.
+    bool compile(const std::string &Source);
+
+    // lookup returns the function Name taking one double per Args, or
+    // nullptr if there is none.
+    template <typename... Args> double (*lookup(const std::string &Name))(Args...) {
+        static_assert((std::is_same_v<Args, double> && ...),
+                      "Kaleidoscope functions only take doubles");
+        return reinterpret_cast<double (*)(Args...)>(lookupAddress(Name, sizeof...(Args)));
+    }
+
+    // registerExtern makes the host function Fn callable from Kaleidoscope
+    // code as Name, as if it was declared with extern.
+    template <typename... Args> bool registerExtern(const std::string &Name, double (*Fn)(Args...)) {
+        static_assert((std::is_same_v<Args, double> && ...),
+                      "Kaleidoscope functions only take doubles");
+        return addHostFunction(Name, sizeof...(Args), reinterpret_cast<void *>(Fn));
+    }
+
+    // getError describes the last failed call.
+    const std::string &getError() const { return Error; }
+
+private:
+    std::string Error;
+
+    void *lookupAddress(const std::string &Name, size_t Arity);
+    bool addHostFunction(const std::string &Name, size_t Arity, void *Fn);
+};
+
+#endif // ENGINE_HPP
@@ -0,0 +1,438 @@
+#include "eval.hpp"
+#include "debuginfo.hpp"
+#include "mathlib.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include <cmath>
+
+using namespace llvm;
+
+unsigned PartialEvalBudget = 100000;
+unsigned InterpretCostThreshold = 200;
+bool SpecializeConstantCalls = false;
+unsigned CallEvalBudget = 0;
+IfSelectMode IfSelect = IfSelectMode::Auto;
+unsigned SelectCostThreshold = 16;
+
+// Calls nest at most this deep during evaluation, which keeps deep recursion
+// from running the compiler out of stack before the budget runs out.
+static const unsigned MaxEvalDepth = 1000;
+
+// Each function is given in double and in float, see MathBuiltin::apply.
+#define MATH_BUILTIN(Name, Arity, ID, ...)                                                 \
+    {#Name, Arity, [](const double *A) { return std::Name(__VA_ARGS__); },                    \
+     [](const float *A) { return std::Name(__VA_ARGS__); }, ID}
+
+static const MathBuiltin MathBuiltins[] = {
+    MATH_BUILTIN(sin, 1, Intrinsic::sin, A[0]),
+    MATH_BUILTIN(cos, 1, Intrinsic::cos, A[0]),
+    MATH_BUILTIN(tan, 1, Intrinsic::not_intrinsic, A[0]),
+    MATH_BUILTIN(atan, 1, Intrinsic::not_intrinsic, A[0]),
+    MATH_BUILTIN(atan2, 2, Intrinsic::not_intrinsic, A[0], A[1]),
+    MATH_BUILTIN(exp, 1, Intrinsic::exp, A[0]),
+    MATH_BUILTIN(log, 1, Intrinsic::log, A[0]),
+    MATH_BUILTIN(sqrt, 1, Intrinsic::sqrt, A[0]),
+    MATH_BUILTIN(pow, 2, Intrinsic::pow, A[0], A[1]),
+    MATH_BUILTIN(fabs, 1, Intrinsic::fabs, A[0]),
+    MATH_BUILTIN(floor, 1, Intrinsic::floor, A[0]),
+    MATH_BUILTIN(ceil, 1, Intrinsic::ceil, A[0]),
+    MATH_BUILTIN(fma, 3, Intrinsic::fma, A[0], A[1], A[2]),
+    MATH_BUILTIN(exp2, 1, Intrinsic::exp2, A[0]),
+    MATH_BUILTIN(log2, 1, Intrinsic::log2, A[0]),
+    MATH_BUILTIN(log10, 1, Intrinsic::log10, A[0]),
+    MATH_BUILTIN(round, 1, Intrinsic::round, A[0]),
+    MATH_BUILTIN(trunc, 1, Intrinsic::trunc, A[0]),
+    MATH_BUILTIN(fmin, 2, Intrinsic::minnum, A[0], A[1]),
+    MATH_BUILTIN(fmax, 2, Intrinsic::maxnum, A[0], A[1]),
+    MATH_BUILTIN(asin, 1, Intrinsic::not_intrinsic, A[0]),
+    MATH_BUILTIN(acos, 1, Intrinsic::not_intrinsic, A[0]),
+    MATH_BUILTIN(sinh, 1, Intrinsic::not_intrinsic, A[0]),
+    MATH_BUILTIN(cosh, 1, Intrinsic::not_intrinsic, A[0]),
+    MATH_BUILTIN(tanh, 1, Intrinsic::not_intrinsic, A[0]),
+    MATH_BUILTIN(cbrt, 1, Intrinsic::not_intrinsic, A[0]),
+    MATH_BUILTIN(hypot, 2, Intrinsic::not_intrinsic, A[0], A[1]),
+};
+#undef MATH_BUILTIN
+
+const MathBuiltin *findMathBuiltin(const std::string &Name, size_t Arity) {
+    // A host or library function under the name of one is its own.
+    if (HostFunctions.count(Name) || ImportedFunctions.count(Name))
+        return nullptr;
+    for (const auto &B : MathBuiltins)
+        if (Name == B.Name && Arity == B.Arity)
+            return &B;
+    return nullptr;
+}
+
+double MathBuiltin::apply(const double *Args, Precision P) const {
+    if (P != Precision::F32 || !UseMathBuiltins || Intrinsic == Intrinsic::not_intrinsic)
+        return Impl(Args);
+    float FloatArgs[3];
+    for (unsigned i = 0; i != Arity; ++i)
+        FloatArgs[i] = Args[i];
+    return ImplF(FloatArgs);
+}
+
+std::optional<double> Evaluator::evaluate(ExprAST &E) {
+    if (!charge())
+        return std::nullopt;
+    return E.evaluate(*this);
+}
+
+bool Evaluator::charge() {
+    if (Budget == 0)
+        return false;
+    --Budget;
+    return true;
+}
+
+std::optional<double> Evaluator::call(const std::string &Callee, const std::vector<double> &Args) {
+    // User definitions shadow the math library.
+    auto DI = FunctionDefs.find(Callee);
+    if (DI == FunctionDefs.end()) {
+        // Math functions still have to be declared with extern first.
+        if (!FunctionProtos.count(Callee))
+            return std::nullopt;
+        if (auto *B = findMathBuiltin(Callee, Args.size()))
+            return B->apply(Args.data(), Prec);
+        if (AllowSideEffects)
+            return callHost(Callee, Args);
+        return std::nullopt;
+    }
+
+    FunctionAST &Def = *DI->second;
+    const auto &Params = Def.getProto()->getArgs();
+    if (Params.size() != Args.size() || Depth == MaxEvalDepth)
+        return std::nullopt;
+
+    // Functions only see their own arguments.
+    std::map<std::string, double> CallerVars;
+    std::swap(Vars, CallerVars);
+    Precision CallerPrec = Prec;
+    Prec = Def.getProto()->getPrecision();
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+        Vars[Params[i]] = narrow(Args[i]);
+
+    ++Depth;
+    auto Result = evaluate(*Def.getBody());
+    --Depth;
+    std::swap(Vars, CallerVars);
+    Prec = CallerPrec;
+    return Result;
+}
+
+std::optional<double> Evaluator::callHost(const std::string &Callee,
+                                          const std::vector<double> &Args) {
+    auto Sym = ExitOnErr(TheJIT->lookup(Callee));
+    auto Addr = Sym.getAddress();
+    const double *A = Args.data();
+    switch (Args.size()) {
+    case 0:
+        return Addr.toPtr<double (*)()>()();
+    case 1:
+        return Addr.toPtr<double (*)(double)>()(A[0]);
+    case 2:
+        return Addr.toPtr<double (*)(double, double)>()(A[0], A[1]);
+    case 3:
+        return Addr.toPtr<double (*)(double, double, double)>()(A[0], A[1], A[2]);
+    case 4:
+        return Addr.toPtr<double (*)(double, double, double, double)>()(A[0], A[1], A[2], A[3]);
+    case 5:
+        return Addr.toPtr<double (*)(double, double, double, double, double)>()(A[0], A[1], A[2],
+                                                                                A[3], A[4]);
+    case 6:
+        return Addr.toPtr<double (*)(double, double, double, double, double, double)>()(
+            A[0], A[1], A[2], A[3], A[4], A[5]);
+    default:
+        return std::nullopt;
+    }
+}
+
+std::optional<double> Evaluator::getVar(const std::string &Name) const {
+    auto I = Vars.find(Name);
+    if (I == Vars.end())
+        return std::nullopt;
+    return I->second;
+}
+
+// The evaluate implementations below mirror the code each node generates, so
+// that folding never changes the result of a program.
+
+std::optional<double> NumberExprAST::evaluate(Evaluator &E) { return E.narrow(Val); }
+
+std::optional<double> VariableExprAST::evaluate(Evaluator &E) {
+    // Unknown variables read as 0.0, just like in codegen.
+    return E.getVar(Name).value_or(0.0);
+}
+
+std::optional<double> BinaryExprAST::evaluate(Evaluator &E) {
+    auto Leaf = [&](ExprAST &X) { return E.evaluate(X); };
+    auto Combine = [&](BinaryExprAST &B, double L, double R) -> std::optional<double> {
+        // Operators below this one don't go through Evaluator::evaluate.
+        if (&B != this && !E.charge())
+            return std::nullopt;
+        switch (B.Op) {
+        case '+':
+            return E.narrow(L + R);
+        case '-':
+            return E.narrow(L - R);
+        case '*':
+            return E.narrow(L * R);
+        case '/':
+            return E.narrow(L / R);
+        case '<':
+            // fcmp ult is also true when either side is NaN.
+            return !(L >= R) ? 1.0 : 0.0;
+        case '>':
+            return !(L <= R) ? 1.0 : 0.0;
+        default:
+            return std::nullopt;
+        }
+    };
+    return fold<double>(Leaf, Combine);
+}
+
+std::optional<double> CallExprAST::evaluate(Evaluator &E) {
+    std::vector<double> ArgVals;
+    for (auto &Arg : Args) {
+        auto V = E.evaluate(*Arg);
+        if (!V)
+            return std::nullopt;
+        ArgVals.push_back(*V);
+    }
+    // The result comes back as a double, whatever the callee computed in.
+    auto Result = E.call(Callee, ArgVals);
+    if (!Result)
+        return std::nullopt;
+    return E.narrow(*Result);
+}
+
+// isTrue matches the fcmp one against 0.0 used for conditions.
+static bool isTrue(double V) { return V < 0.0 || V > 0.0; }
+
+std::optional<double> IfExprAST::evaluate(Evaluator &E) {
+    auto C = E.evaluate(*Cond);
+    if (!C)
+        return std::nullopt;
+    return E.evaluate(isTrue(*C) ? *Then : *Else);
+}
+
+std::optional<double> ForExprAST::evaluate(Evaluator &E) {
+    auto StartVal = E.evaluate(*Start);
+    if (!StartVal)
+        return std::nullopt;
+    auto OldVal = E.getVar(VarName);
+
+    // A plain loop evaluates to 0.0, which is also the identity of a sum.
+    std::optional<double> Result = identity(Kind);
+    E.setVar(VarName, *StartVal);
+    while (true) {
+        auto C = E.evaluate(*Cond);
+        if (!C) {
+            Result = std::nullopt;
+            break;
+        }
+        if (!isTrue(*C))
+            break;
+        std::optional<double> StepVal;
+        if (auto BodyVal = E.evaluate(*Body)) {
+            Result = E.narrow(reduce(Kind, *Result, *BodyVal));
+            StepVal = E.evaluate(*Step);
+        }
+        if (!StepVal) {
+            Result = std::nullopt;
+            break;
+        }
+        E.setVar(VarName, E.narrow(*E.getVar(VarName) + *StepVal));
+    }
+
+    if (OldVal)
+        E.setVar(VarName, *OldVal);
+    else
+        E.unsetVar(VarName);
+    return Result;
+}
+
+unsigned CostEstimator::estimateCall(const std::string &Callee, unsigned NumArgs) {
+    auto DI = FunctionDefs.find(Callee);
+    if (DI != FunctionDefs.end() && !AllowUserCalls)
+        return Unbounded;
+    if (DI == FunctionDefs.end()) {
+        // Externs run natively, so they are cheap but may do anything.
+        auto PI = FunctionProtos.find(Callee);
+        if (PI == FunctionProtos.end() || PI->second->getArgs().size() != NumArgs)
+            return Unbounded;
+        if (!findMathBuiltin(Callee, NumArgs)) {
+            if (NumArgs > MaxHostCallArgs)
+                return Unbounded;
+            HasSideEffects = true;
+        }
+        return 1;
+    }
+
+    FunctionAST &Def = *DI->second;
+    if (Def.getProto()->getArgs().size() != NumArgs || !Active.insert(Callee).second)
+        return Unbounded;
+    unsigned Cost = estimate(*Def.getBody());
+    Active.erase(Callee);
+    return add(Cost, 1);
+}
+
+unsigned NumberExprAST::estimateCost(CostEstimator &C) { return 1; }
+
+unsigned VariableExprAST::estimateCost(CostEstimator &C) { return 1; }
+
+unsigned BinaryExprAST::estimateCost(CostEstimator &C) {
+    auto Leaf = [&](ExprAST &X) -> std::optional<unsigned> { return C.estimate(X); };
+    auto Combine = [&](BinaryExprAST &, unsigned L, unsigned R) -> std::optional<unsigned> {
+        return C.add(C.add(L, R), 1);
+    };
+    return *fold<unsigned>(Leaf, Combine);
+}
+
+unsigned CallExprAST::estimateCost(CostEstimator &C) {
+    unsigned Cost = C.estimateCall(Callee, Args.size());
+    for (auto &Arg : Args)
+        Cost = C.add(Cost, C.estimate(*Arg));
+    return Cost;
+}
+
+unsigned IfExprAST::estimateCost(CostEstimator &C) {
+    unsigned Cost = C.add(C.estimate(*Cond), 1);
+    return C.add(Cost, std::max(C.estimate(*Then), C.estimate(*Else)));
+}
+
+unsigned ForExprAST::estimateCost(CostEstimator &C) {
+    // The trip count is unknown. Walk the parts anyway so side effects in them
+    // are noticed.
+    C.estimate(*Start);
+    C.estimate(*Cond);
+    C.estimate(*Step);
+    C.estimate(*Body);
+    return CostEstimator::Unbounded;
+}
+
+bool shouldUseSelect(ExprAST &Then, ExprAST &Else) {
+    if (IfSelect == IfSelectMode::Never || isProfiling())
+        return false;
+    CostEstimator C;
+    C.AllowUserCalls = false;
+    unsigned Cost = C.add(C.estimate(Then), C.estimate(Else));
+    if (C.HasSideEffects || Cost == CostEstimator::Unbounded)
+        return false;
+    return IfSelect == IfSelectMode::Always || Cost <= SelectCostThreshold;
+}
+
+// Calls inside a specialized clone are not specialized again, which bounds the
+// number of clones a single call can produce.
+static unsigned SpecializationDepth = 0;
+
+Function *emitSpecialization(FunctionAST &Def, ArrayRef<Value *> ArgsV) {
+    const auto &Params = Def.getProto()->getArgs();
+    std::string Name = Def.getProto()->getName() + ".spec";
+    std::vector<std::string> CloneParams;
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i) {
+        if (auto *C = dyn_cast<ConstantFP>(ArgsV[i])) {
+            char Buf[32];
+            snprintf(Buf, sizeof(Buf), ".%.17g", C->getValueAPF().convertToDouble());
+            Name += Buf;
+        } else {
+            Name += "._";
+            CloneParams.push_back(Params[i]);
+        }
+    }
+    if (auto *F = TheModule->getFunction(Name))
+        return F;
+
+    std::vector<Type *> Doubles(CloneParams.size(), Type::getDoubleTy(*TheContext));
+    FunctionType *FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+    Function *F = Function::Create(FT, Function::InternalLinkage, Name, TheModule.get());
+    ++Stats.Specializations;
+
+    // We are in the middle of generating the caller, so set its state aside.
+    BasicBlock *CallerBB = Builder->GetInsertBlock();
+    BasicBlock::iterator CallerIP = Builder->GetInsertPoint();
+    DebugLoc CallerLoc = Builder->getCurrentDebugLocation();
+    std::map<std::string, Value *> CallerValues;
+    std::swap(NamedValues, CallerValues);
+    Precision CallerPrecision = CurPrecision;
+    CurPrecision = Def.getProto()->getPrecision();
+
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", F));
+    auto FArg = F->arg_begin();
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i) {
+        if (isa<ConstantFP>(ArgsV[i])) {
+            NamedValues[Params[i]] = toNum(ArgsV[i]);
+        } else {
+            FArg->setName(Params[i]);
+            NamedValues[Params[i]] = toNum(&*FArg++);
+        }
+    }
+
+    beginFunctionDebugInfo(F, *Def.getProto());
+    emitLocation(Def.getBody());
+    ++SpecializationDepth;
+    Value *RetVal = Def.getBody()->codegen();
+    --SpecializationDepth;
+    endFunctionDebugInfo();
+
+    if (RetVal) {
+        Builder->CreateRet(toDouble(RetVal));
+        verifyFunction(*F);
+        TheFPM->run(*F, *TheFAM);
+    } else {
+        F->eraseFromParent();
+        F = nullptr;
+    }
+
+    std::swap(NamedValues, CallerValues);
+    CurPrecision = CallerPrecision;
+    Builder->SetInsertPoint(CallerBB, CallerIP);
+    Builder->SetCurrentDebugLocation(CallerLoc);
+    return F;
+}
+
+Value *partiallyEvaluateCall(const std::string &Callee, ArrayRef<Value *> ArgsV) {
+    if (PartialEvalBudget == 0)
+        return nullptr;
+
+    std::vector<double> Consts;
+    for (Value *V : ArgsV)
+        if (auto *C = dyn_cast<ConstantFP>(V))
+            Consts.push_back(C->getValueAPF().convertToDouble());
+
+    auto DI = FunctionDefs.find(Callee);
+    bool IsUserFunction = DI != FunctionDefs.end();
+
+    // Known math functions are folded anywhere, since they can't change.
+    if (!IsUserFunction) {
+        auto *B = findMathBuiltin(Callee, ArgsV.size());
+        if (B && Consts.size() == ArgsV.size())
+            return ConstantFP::get(*TheContext, APFloat(B->apply(Consts.data(), CurPrecision)));
+        return nullptr;
+    }
+
+    if (!SpecializeConstantCalls || Consts.empty())
+        return nullptr;
+
+    // With every argument known, try to run the whole call now.
+    if (Consts.size() == ArgsV.size() && CallEvalBudget > 0) {
+        Evaluator E(CallEvalBudget);
+        auto V = E.call(Callee, Consts);
+        CallEvalBudget = E.remaining();
+        if (V)
+            return ConstantFP::get(*TheContext, APFloat(*V));
+    }
+
+    if (SpecializationDepth > 0)
+        return nullptr;
+
+    Function *Clone = emitSpecialization(*DI->second, ArgsV);
+    if (!Clone)
+        return nullptr;
+    std::vector<Value *> CloneArgs;
+    for (Value *V : ArgsV)
+        if (!isa<ConstantFP>(V))
+            CloneArgs.push_back(V);
+    return Builder->CreateCall(Clone, CloneArgs, "calltmp");
+}
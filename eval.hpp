@@ -0,0 +1,147 @@
+// eval.hpp
+#ifndef EVAL_HPP
+#define EVAL_HPP
+
+#include "ast.hpp"
+#include "llvm/IR/Intrinsics.h"
+#include <climits>
+#include <optional>
+#include <set>
+
+// A function from the C math library that the compiler knows to be pure, so
+// calls to it can be folded when their arguments are constants. Calls that
+// remain are lowered to Intrinsic, when LLVM has one, see mathlib.hpp.
+struct MathBuiltin {
+    const char *Name;
+    unsigned Arity;
+    double (*Impl)(const double *Args);
+    float (*ImplF)(const float *Args);
+    llvm::Intrinsic::ID Intrinsic;
+
+    // apply computes the function the way code of precision P calls it: f32
+    // code lowers it to the float intrinsic when there is one, which calls
+    // the float version such as sinf, and calls the double one otherwise.
+    double apply(const double *Args, Precision P) const;
+};
+
+// findMathBuiltin returns the known math function called Name taking Arity
+// arguments, or nullptr if there is none or the host or an imported module
+// defines Name.
+const MathBuiltin *findMathBuiltin(const std::string &Name, size_t Arity);
+
+// Evaluator walks the AST to compute values without generating code. By
+// default it runs at compile time and only does pure computation: calls to
+// other externs such as printd make it give up, as does running out of its
+// step budget. With AllowSideEffects it is an interpreter, and calls externs
+// in the host process like the compiled code would.
+class Evaluator {
+    unsigned Budget;
+    bool AllowSideEffects;
+    unsigned Depth = 0;
+    std::map<std::string, double> Vars;
+    // The precision of the code being evaluated, see narrow.
+    Precision Prec = DefaultPrecision;
+
+    std::optional<double> callHost(const std::string &Callee, const std::vector<double> &Args);
+
+public:
+    explicit Evaluator(unsigned Budget, bool AllowSideEffects = false)
+        : Budget(Budget), AllowSideEffects(AllowSideEffects) {}
+
+    // charge takes one step from the budget, for nodes visited without
+    // evaluate. It returns false if there is none left.
+    bool charge();
+
+    // remaining returns the steps left in the budget.
+    unsigned remaining() const { return Budget; }
+
+    // evaluate returns the value of E, or std::nullopt if it cannot be
+    // computed without side effects within the budget.
+    std::optional<double> evaluate(ExprAST &E);
+
+    // call evaluates a call to Callee with the given argument values.
+    std::optional<double> call(const std::string &Callee, const std::vector<double> &Args);
+
+    // narrow rounds V like the compiled code would store it. Rounding the
+    // exact double result of +, -, * and / to a float gives the float result.
+    double narrow(double V) const { return Prec == Precision::F32 ? (float)V : V; }
+
+    std::optional<double> getVar(const std::string &Name) const;
+    void setVar(const std::string &Name, double Val) { Vars[Name] = Val; }
+    void unsetVar(const std::string &Name) { Vars.erase(Name); }
+};
+
+// CostEstimator estimates how many nodes an evaluation of an expression visits,
+// walking into the bodies of the functions it calls.
+class CostEstimator {
+    // Functions currently being walked, used to spot recursion.
+    std::set<std::string> Active;
+
+public:
+    // The cost of loops, recursion and anything that can't be interpreted.
+    static const unsigned Unbounded = UINT_MAX;
+
+    // Set once the expression calls an extern other than a known math function.
+    bool HasSideEffects = false;
+
+    // When cleared, calls to user functions cost Unbounded instead of their
+    // body. Code that runs speculatively can't call them, since a later
+    // redefinition could give them side effects.
+    bool AllowUserCalls = true;
+
+    unsigned estimate(ExprAST &E) { return E.estimateCost(*this); }
+    unsigned estimateCall(const std::string &Callee, unsigned NumArgs);
+
+    // add sums costs, saturating at Unbounded.
+    static unsigned add(unsigned A, unsigned B) { return A > Unbounded - B ? Unbounded : A + B; }
+};
+
+// MaxHostCallArgs is the largest number of arguments the interpreter can pass
+// to an extern.
+const unsigned MaxHostCallArgs = 6;
+
+// InterpretCostThreshold is the largest estimated cost for which a top-level
+// expression is interpreted instead of JIT-compiled. Zero disables the
+// interpreter.
+extern unsigned InterpretCostThreshold;
+
+// How an if is generated: with a branch around each arm, or by evaluating
+// both arms and picking one with a select, which avoids mispredicted branches
+// and lets enclosing loops vectorize. Selects are only used when neither arm
+// has side effects or calls a user function, and in Auto mode when the arms
+// together cost at most SelectCostThreshold. Ifs always branch while
+// profiling, so that both runs count the same branches.
+enum class IfSelectMode { Never, Auto, Always };
+extern IfSelectMode IfSelect;
+extern unsigned SelectCostThreshold;
+
+// shouldUseSelect decides how to generate the if with these arms.
+bool shouldUseSelect(ExprAST &Then, ExprAST &Else);
+
+// PartialEvalBudget is the number of AST nodes the evaluator may visit for a
+// single call. Zero disables partial evaluation.
+extern unsigned PartialEvalBudget;
+
+// SpecializeConstantCalls is set while generating code for a top-level
+// expression. Calls to user functions are only evaluated or specialized there,
+// since a function body compiled against them would go stale on redefinition.
+extern bool SpecializeConstantCalls;
+
+// CallEvalBudget is what the calls folded while generating a top-level
+// expression may spend between them. It starts at what is left of
+// PartialEvalBudget after trying to evaluate the whole expression, which
+// already tried those calls.
+extern unsigned CallEvalBudget;
+
+// partiallyEvaluateCall is used by CallExprAST::codegen. It folds calls with
+// constant arguments to a constant, or redirects them to a clone of the callee
+// specialized on those arguments. It returns nullptr if neither applies.
+llvm::Value *partiallyEvaluateCall(const std::string &Callee, llvm::ArrayRef<llvm::Value *> ArgsV);
+
+// emitSpecialization emits a copy of Def into the current module with the
+// constant arguments in ArgsV substituted for the matching parameters. The
+// copy takes the other arguments, in order. It returns nullptr if the body
+// fails to generate.
+llvm::Function *emitSpecialization(FunctionAST &Def, llvm::ArrayRef<llvm::Value *> ArgsV);
+
+#endif // EVAL_HPP
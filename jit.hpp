@@ -13,24 +13,69 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Target/TargetMachine.h"
+#include <atomic>
 #include <memory>
 
 namespace llvm {
 namespace orc {
 
+/// A SectionMemoryManager that keeps count of the code and data it holds.
+/// Every loaded object gets its own, which frees its sections when the
+/// object is removed.
+class AccountingMemoryManager : public SectionMemoryManager {
+  uintptr_t CodeSize = 0;
+  uintptr_t DataSize = 0;
+
+public:
+  /// Totals over every live object.
+  static inline std::atomic<uint64_t> CodeBytes{0};
+  static inline std::atomic<uint64_t> DataBytes{0};
+  static inline std::atomic<uint64_t> Objects{0};
+
+  AccountingMemoryManager() { ++Objects; }
+
+  ~AccountingMemoryManager() override {
+    CodeBytes -= CodeSize;
+    DataBytes -= DataSize;
+    --Objects;
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    CodeSize += Size;
+    CodeBytes += Size;
+    return SectionMemoryManager::allocateCodeSection(Size, Alignment,
+                                                     SectionID, SectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    DataSize += Size;
+    DataBytes += Size;
+    return SectionMemoryManager::allocateDataSection(
+        Size, Alignment, SectionID, SectionName, IsReadOnly);
+  }
+};
+
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
@@ -43,15 +88,34 @@ private:
 
   JITDylib &MainJD;
 
+  // Every named function is called through a stub so that its body can be
+  // replaced without touching its callers.
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
+
+  // Resource tracker owning the current body of each stubbed function.
+  StringMap<ResourceTrackerSP> BodyTrackers;
+
+  // Where lookups search: MainJD, then each imported library in order.
+  std::vector<JITDylib *> SearchOrder;
+
+  // Describes the host to the optimizer, e.g. its vector width.
+  std::unique_ptr<TargetMachine> TM;
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  std::unique_ptr<IndirectStubsManager> StubsMgr,
+                  std::unique_ptr<TargetMachine> TM)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
         ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+                    []() {
+                      return std::make_unique<AccountingMemoryManager>();
+                    }),
         CompileLayer(*this->ES, ObjectLayer,
                      std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+        MainJD(this->ES->createBareJITDylib("<main>")),
+        StubsMgr(std::move(StubsMgr)), SearchOrder({&MainJD}),
+        TM(std::move(TM)) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
@@ -73,29 +137,109 @@ public:
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    // Compile for the CPU we run on, so that e.g. AVX2 can be used.
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
 
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    auto TM = JTMB->createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+
+    auto StubsMgr =
+        createLocalIndirectStubsManagerBuilder(JTMB->getTargetTriple())();
+
+    return std::make_unique<KaleidoscopeJIT>(
+        std::move(ES), std::move(*JTMB), std::move(*DL), std::move(StubsMgr),
+        std::move(*TM));
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  /// The target the JIT compiles for, to give the optimizer cost models.
+  TargetMachine &getTargetMachine() { return *TM; }
+
+  /// Notify \p L of every object the JIT loads and frees, e.g. to make the
+  /// generated code visible to debuggers and profilers.
+  void registerJITEventListener(JITEventListener &L) {
+    ObjectLayer.registerJITEventListener(L);
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  /// Add a module containing the body \p ImplName of function \p Name, and
+  /// route calls to \p Name through a stub pointing at that body. If \p Name
+  /// already has a body, the stub is swapped to the new one and the code of
+  /// the old body is freed.
+  Error addFunction(ThreadSafeModule TSM, StringRef Name, StringRef ImplName) {
+    auto RT = MainJD.createResourceTracker();
+    if (auto Err = CompileLayer.add(RT, std::move(TSM)))
+      return Err;
+
+    auto Impl = ES->lookup({&MainJD}, Mangle(ImplName.str()));
+    if (!Impl)
+      return joinErrors(Impl.takeError(), RT->remove());
+
+    auto Prev = BodyTrackers.find(Name);
+    if (Prev == BodyTrackers.end()) {
+      if (auto Err = StubsMgr->createStub(
+              Name, Impl->getAddress(),
+              JITSymbolFlags::Exported | JITSymbolFlags::Callable))
+        return joinErrors(std::move(Err), RT->remove());
+      auto Stub = StubsMgr->findStub(Name, /*ExportedStubsOnly=*/true);
+      if (auto Err = MainJD.define(absoluteSymbols({{Mangle(Name.str()), Stub}})))
+        return joinErrors(std::move(Err), RT->remove());
+      BodyTrackers[Name] = std::move(RT);
+      return Error::success();
+    }
+
+    // Callers only ever see the stub, so repointing it is enough to switch
+    // them over. The old body can go once nothing refers to it any more.
+    if (auto Err = StubsMgr->updatePointer(Name, Impl->getAddress()))
+      return joinErrors(std::move(Err), RT->remove());
+    std::swap(Prev->second, RT);
+    return RT->remove();
+  }
+
+  /// Call \p F with each module once it is compiled, just before the module
+  /// is freed.
+  void setNotifyCompiled(IRCompileLayer::NotifyCompiledFunction F) {
+    CompileLayer.setNotifyCompiled(std::move(F));
+  }
+
+  /// Define \p Name in the main JITDylib as the host function at \p Addr.
+  Error addHostFunction(StringRef Name, ExecutorAddr Addr) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          {Addr, JITSymbolFlags::Exported | JITSymbolFlags::Callable}}}));
+  }
+
+  /// Add \p TSM as a library in a JITDylib of its own named \p Name. Code in
+  /// the main JITDylib sees its symbols after those of the main JITDylib.
+  Error addLibrary(ThreadSafeModule TSM, StringRef Name) {
+    JITDylib &LibJD = ES->createBareJITDylib(Name.str());
+    // The library may call into the host process, just like MainJD.
+    LibJD.addGenerator(cantFail(
+        DynamicLibrarySearchGenerator::GetForCurrentProcess(DL.getGlobalPrefix())));
+    if (auto Err = CompileLayer.add(LibJD, std::move(TSM)))
+      return Err;
+    MainJD.addToLinkOrder(LibJD);
+    SearchOrder.push_back(&LibJD);
+    return Error::success();
+  }
+
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
-    return ES->lookup({&MainJD}, Mangle(Name.str()));
+    return ES->lookup(SearchOrder, Mangle(Name.str()));
   }
 };
 
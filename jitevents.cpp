@@ -0,0 +1,76 @@
+#include "jitevents.hpp"
+#include "ast.hpp"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/SymbolSize.h"
+#include <unistd.h>
+
+using namespace llvm;
+
+bool WritePerfMap = false;
+bool WriteJITDump = false;
+bool RegisterWithGDB = false;
+
+namespace {
+
+// PerfMapListener appends a line for every function in every loaded object to
+// the perf map file of this process.
+class PerfMapListener : public JITEventListener {
+    FILE *Out;
+
+public:
+    explicit PerfMapListener(FILE *Out) : Out(Out) {}
+
+    void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                            const RuntimeDyld::LoadedObjectInfo &L) override {
+        // The debug object has its sections at their load addresses.
+        object::OwningBinary<object::ObjectFile> DebugObj = L.getObjectForDebug(Obj);
+        if (!DebugObj.getBinary())
+            return;
+
+        for (const auto &[Sym, Size] : object::computeSymbolSizes(*DebugObj.getBinary())) {
+            auto Type = Sym.getType();
+            if (!Type || *Type != object::SymbolRef::ST_Function) {
+                consumeError(Type.takeError());
+                continue;
+            }
+            auto Name = Sym.getName();
+            auto Addr = Sym.getAddress();
+            if (!Name || !Addr) {
+                consumeError(Name.takeError());
+                consumeError(Addr.takeError());
+                continue;
+            }
+            fprintf(Out, "%llx %llx %s\n", (unsigned long long)*Addr, (unsigned long long)Size,
+                    Name->str().c_str());
+        }
+        // perf may read the file while we are still running.
+        fflush(Out);
+    }
+};
+
+} // end anonymous namespace
+
+bool registerJITEventListeners() {
+    if (WritePerfMap) {
+        std::string Path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        FILE *Out = fopen(Path.c_str(), "w");
+        if (!Out) {
+            fprintf(stderr, "Error: cannot write perf map %s\n", Path.c_str());
+            return false;
+        }
+        // Listeners have to outlive the JIT, which is only torn down at exit,
+        // so this one is never freed.
+        TheJIT->registerJITEventListener(*new PerfMapListener(Out));
+    }
+    if (WriteJITDump) {
+        JITEventListener *Listener = JITEventListener::createPerfJITEventListener();
+        if (!Listener) {
+            fprintf(stderr, "Error: this LLVM was built without perf jitdump support\n");
+            return false;
+        }
+        TheJIT->registerJITEventListener(*Listener);
+    }
+    if (RegisterWithGDB)
+        TheJIT->registerJITEventListener(*JITEventListener::createGDBRegistrationListener());
+    return true;
+}
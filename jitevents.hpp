@@ -0,0 +1,22 @@
+// jitevents.hpp
+#ifndef JITEVENTS_HPP
+#define JITEVENTS_HPP
+
+// Options for making JIT-compiled code visible to profilers and debuggers.
+
+// WritePerfMap writes /tmp/perf-<pid>.map, which perf reads to name samples in
+// JIT-compiled functions.
+extern bool WritePerfMap;
+
+// WriteJITDump writes jit-<pid>.dump records for `perf inject --jit`, which
+// also carry line info when compiling with -g. It needs an LLVM built with
+// LLVM_USE_PERF.
+extern bool WriteJITDump;
+
+// RegisterWithGDB registers every object through the GDB JIT interface.
+extern bool RegisterWithGDB;
+
+// registerJITEventListeners attaches the listeners selected above to TheJIT.
+bool registerJITEventListeners();
+
+#endif // JITEVENTS_HPP
@@ -1,8 +1,11 @@
 // lexer.cpp
 #include "lexer.hpp"
+#include "scan.hpp"
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <sstream>
+#include <string_view>
 
 using namespace std; // Safe to use in cpp files
 
@@ -11,55 +14,73 @@ string IdentifierStr;
 double NumVal;
 int CurTok;
 bool EXIT_ON_ERROR = false;
+SourceLocation CurLoc;
+std::string SourceFileName = "<stdin>";
 
-std::ifstream *file = nullptr;
+// Location of the last character read.
+static SourceLocation LexLoc = {1, 0};
+
+// The character before it, so that \r\n counts as one line break.
+static char PrevChar = 0;
+
+std::istream *file = nullptr;
+
+// Last character read and not yet turned into a token.
+static int LastChar = ' ';
+
+// File input is read a block at a time, so that runs of characters can be
+// scanned in place, see scan.hpp. Interactive input is read a character at a
+// time, so that a line is handled as soon as it is typed.
+static char Buffer[1 << 16];
+static const char *BufPos = nullptr;
+static const char *BufEnd = nullptr;
 
 char readChar();
+static void readRun(const char *(*Scan)(const char *, const char *), bool (*InClass)(int),
+                    std::string *Out, bool SpansLines = false);
 
 // Helper functions
 bool is_alpha(int c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
 
 bool is_alnum(int c) { return is_alpha(c) || (c >= '0' && c <= '9'); }
 
+static bool is_space(int c) { return isspace(c); }
+
+static bool is_number(int c) { return isdigit(c) || c == '.'; }
+
+static bool is_comment(int c) { return c != EOF && c != '\n' && c != '\r'; }
+
+// keywordToken returns the token for the keyword Str, or tok_identifier if it
+// isn't one. Comparing lengths first keeps this cheap for other identifiers.
+static int keywordToken(std::string_view Str) {
+    static const std::pair<std::string_view, Token> Keywords[] = {
+        {"def", tok_def},   {"extern", tok_extern}, {"close", tok_close},
+        {"if", tok_if},     {"then", tok_then},     {"else", tok_else},
+        {"for", tok_for},   {"in", tok_in},         {"import", tok_import},
+    };
+    for (auto &[Name, Tok] : Keywords)
+        if (Str == Name)
+            return Tok;
+    return tok_identifier;
+}
+
 // gettokn - Return the next token from standard input.
 int gettokn() {
-    static int LastChar = ' ';
-
     // Skip any whitespace.
-    while (isspace(LastChar))
-        LastChar = readChar();
+    if (isspace(LastChar))
+        readRun(getScanners().Whitespace, is_space, nullptr, /*SpansLines=*/true);
+    CurLoc = LexLoc;
     // Check if the character is an alphabet
     if (is_alpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
         IdentifierStr = LastChar;
-        while (is_alnum((LastChar = readChar())))
-            IdentifierStr += LastChar;
-
-        if (IdentifierStr == "def")
-            return tok_def;
-        if (IdentifierStr == "extern")
-            return tok_extern;
-        if (IdentifierStr == "close")
-            return tok_close;
-        if (IdentifierStr == "if")
-            return tok_if;
-        if (IdentifierStr == "then")
-            return tok_then;
-        if (IdentifierStr == "else")
-            return tok_else;
-        if (IdentifierStr == "for")
-            return tok_for;
-        if (IdentifierStr == "in")
-            return tok_in;
-        return tok_identifier;
+        readRun(getScanners().Identifier, is_alnum, &IdentifierStr);
+        return keywordToken(IdentifierStr);
     }
 
     // Check if the character is a number
-    if (isdigit(LastChar) || LastChar == '.') {
-        string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = readChar();
-        } while (isdigit(LastChar) || LastChar == '.');
+    if (is_number(LastChar)) {
+        string NumStr(1, LastChar);
+        readRun(getScanners().Number, is_number, &NumStr);
 
         NumVal = strtod(NumStr.c_str(), 0);
         return tok_number;
@@ -68,9 +89,7 @@ int gettokn() {
     // Check if the character is a comment
     if (LastChar == '#') {
         // Comment until end of line.
-        do
-            LastChar = readChar();
-        while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+        readRun(getScanners().Comment, is_comment, nullptr);
 
         if (LastChar != EOF)
             return gettokn();
@@ -86,30 +105,133 @@ int gettokn() {
     return ThisChar;
 }
 
+// The token read ahead by peekToken, and the values that come with it.
+static bool HasPeeked = false;
+static int PeekedTok;
+static string PeekedIdentifier;
+static double PeekedNum;
+static SourceLocation PeekedLoc;
+
+int peekToken() {
+    if (!HasPeeked) {
+        string Identifier = IdentifierStr;
+        double Num = NumVal;
+        SourceLocation Loc = CurLoc;
+        PeekedTok = gettokn();
+        PeekedIdentifier = std::move(IdentifierStr);
+        PeekedNum = NumVal;
+        PeekedLoc = CurLoc;
+        IdentifierStr = std::move(Identifier);
+        NumVal = Num;
+        CurLoc = Loc;
+        HasPeeked = true;
+    }
+    return PeekedTok;
+}
+
 // Define getNextToken here instead of in the header
-int getNextToken() { return CurTok = gettokn(); }
+int getNextToken() {
+    if (HasPeeked) {
+        HasPeeked = false;
+        IdentifierStr = std::move(PeekedIdentifier);
+        NumVal = PeekedNum;
+        CurLoc = PeekedLoc;
+        return CurTok = PeekedTok;
+    }
+    return CurTok = gettokn();
+}
 
 void readFile(const std::string &filename) {
-    file = new std::ifstream(filename);
-    if (!file->is_open()) {
+    SourceFileName = filename;
+    auto *in = new std::ifstream(filename);
+    if (!in->is_open()) {
         std::cerr << "Error opening file: " << filename << std::endl;
         exit(1);
     }
+    file = in;
+    BufPos = BufEnd = nullptr;
+    HasPeeked = false;
     EXIT_ON_ERROR = true;
 }
 
+void readString(const std::string &source) {
+    closeFile();
+    file = new std::istringstream(source);
+    BufPos = BufEnd = nullptr;
+    SourceFileName = "<string>";
+    LexLoc = {1, 0};
+    PrevChar = 0;
+    LastChar = ' ';
+    HasPeeked = false;
+}
+
 bool isFileSet() { return file != nullptr; }
 
 void closeFile() {
     if (file != nullptr) {
-        file->close();
-        delete file; // free the memory
+        delete file; // closes a file, and frees the memory
+        file = nullptr;
     }
 }
 
+// fillBuffer reads the next block of file input, and returns false at the
+// end of it.
+static bool fillBuffer() {
+    file->read(Buffer, sizeof(Buffer));
+    BufPos = Buffer;
+    BufEnd = Buffer + file->gcount();
+    return BufPos != BufEnd;
+}
+
+static void advanceLoc(char c) {
+    if (c == '\n' && PrevChar == '\r') {
+        // The \r already started the line.
+    } else if (c == '\n' || c == '\r') {
+        LexLoc.Line++;
+        LexLoc.Col = 0;
+    } else {
+        LexLoc.Col++;
+    }
+    PrevChar = c;
+}
+
 char readChar() {
+    char c;
+    if (file == nullptr)
+        c = getchar();
+    else if (BufPos != BufEnd || fillBuffer())
+        c = *BufPos++;
+    else
+        c = EOF;
+    advanceLoc(c);
+    return c;
+}
+
+// readRun reads the characters after LastChar for as long as they are in a
+// class, appending them to Out if it is set, and leaves the first one that is
+// not in LastChar. Scan finds the end of a run in the buffer, and InClass
+// tells about a single character. Only runs that SpansLines may contain line
+// breaks.
+static void readRun(const char *(*Scan)(const char *, const char *), bool (*InClass)(int),
+                    std::string *Out, bool SpansLines) {
     if (file == nullptr) {
-        return getchar();
+        while (InClass(LastChar = readChar()))
+            if (Out)
+                *Out += LastChar;
+        return;
+    }
+    while (BufPos != BufEnd || fillBuffer()) {
+        const char *RunEnd = Scan(BufPos, BufEnd);
+        if (Out)
+            Out->append(BufPos, RunEnd - BufPos);
+        if (SpansLines)
+            for (const char *P = BufPos; P != RunEnd; ++P)
+                advanceLoc(*P);
+        else
+            LexLoc.Col += RunEnd - BufPos;
+        BufPos = RunEnd;
+        if (RunEnd != BufEnd)
+            break;
     }
-    return file->get();
+    LastChar = readChar();
 }
\ No newline at end of file
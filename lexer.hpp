@@ -9,6 +9,9 @@ extern std::string IdentifierStr;
 extern double NumVal;
 extern int CurTok;
 
+// Name of the file being read, "<stdin>" for interactive input.
+extern std::string SourceFileName;
+
 // The lexer returns tokens [0-255] if it is an unknown character, otherwise one
 // of these for known things.
 enum Token {
@@ -23,13 +26,19 @@ enum Token {
     tok_else = -9,
     tok_for = -10,
     tok_in = -11,
+    tok_import = -12,
 };
 
 
 // Declare functions
 int gettokn();
 int getNextToken();
+// peekToken returns the token after CurTok without consuming it.
+int peekToken();
 void readFile(const std::string &filename);
+// readString makes the lexer read source text from a string, starting over
+// after whatever it read before.
+void readString(const std::string &source);
 void closeFile();
 bool isFileSet();
 
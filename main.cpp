@@ -1,18 +1,139 @@
+#include "columns.hpp"
+#include "debuginfo.hpp"
+#include "eval.hpp"
+#include "jitevents.hpp"
 #include "lexer.hpp"
+#include "mathlib.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+#include "purity.hpp"
+#include "stats.hpp"
+#include <cstring>
 #include <iostream>
 
 int main(int argc, char *argv[]) {
+    std::string inputFile;
+    std::string modulePath;
+    for (int i = 1; i < argc; i++) {
+        std::string Arg = argv[i];
+        if (Arg.rfind("--peval-budget=", 0) == 0) {
+            // Step budget for compile-time evaluation, 0 turns it off.
+            PartialEvalBudget = std::stoul(Arg.substr(strlen("--peval-budget=")));
+        } else if (Arg.rfind("--interp-threshold=", 0) == 0) {
+            // Largest estimated cost of an interpreted expression, 0 turns it off.
+            InterpretCostThreshold = std::stoul(Arg.substr(strlen("--interp-threshold=")));
+        } else if (Arg.rfind("--profile-gen=", 0) == 0) {
+            ProfileGenPath = Arg.substr(strlen("--profile-gen="));
+        } else if (Arg.rfind("--profile-use=", 0) == 0) {
+            ProfileUsePath = Arg.substr(strlen("--profile-use="));
+        } else if (Arg == "--perf-map") {
+            WritePerfMap = true;
+        } else if (Arg == "--jitdump") {
+            WriteJITDump = true;
+        } else if (Arg == "--gdb-jit") {
+            RegisterWithGDB = true;
+        } else if (Arg == "-g") {
+            EmitDebugInfo = true;
+        } else if (Arg.rfind("--emit-module=", 0) == 0) {
+            // Compile the input into a precompiled module instead of running it.
+            modulePath = Arg.substr(strlen("--emit-module="));
+        } else if (Arg.rfind("--map=", 0) == 0) {
+            // Run a function over the columns of --in instead of the input's
+            // top-level expressions.
+            MapFunctionName = Arg.substr(strlen("--map="));
+        } else if (Arg.rfind("--in=", 0) == 0) {
+            MapInputPath = Arg.substr(strlen("--in="));
+        } else if (Arg.rfind("--out=", 0) == 0) {
+            MapOutputPath = Arg.substr(strlen("--out="));
+        } else if (Arg.rfind("--threads=", 0) == 0) {
+            MapThreads = std::stoul(Arg.substr(strlen("--threads=")));
+        } else if (Arg == "--map-per-row") {
+            MapPerRow = true;
+        } else if (Arg == "--no-math-builtins") {
+            UseMathBuiltins = false;
+        } else if (Arg == "--no-infer-attrs") {
+            InferAttributes = false;
+        } else if (Arg.rfind("--stats=", 0) == 0) {
+            StatsPath = Arg.substr(strlen("--stats="));
+        } else if (Arg == "--if-select=never") {
+            IfSelect = IfSelectMode::Never;
+        } else if (Arg == "--if-select=auto") {
+            IfSelect = IfSelectMode::Auto;
+        } else if (Arg == "--if-select=always") {
+            IfSelect = IfSelectMode::Always;
+        } else if (Arg.rfind("--select-threshold=", 0) == 0) {
+            // Largest cost of the two arms of an if generated as a select.
+            SelectCostThreshold = std::stoul(Arg.substr(strlen("--select-threshold=")));
+        } else if (Arg == "--pipeline") {
+            PipelineFileMode = true;
+        } else if (Arg == "--no-batch") {
+            BatchTopLevel = false;
+        } else if (Arg == "--fast-reductions") {
+            FastReductions = true;
+        } else if (Arg == "--value-profile") {
+            ValueProfileThreshold = 10000;
+        } else if (Arg.rfind("--value-profile=", 0) == 0) {
+            // Calls recorded before a function is specialized, or not.
+            ValueProfileThreshold = std::stoull(Arg.substr(strlen("--value-profile=")));
+        } else if (Arg == "--precision=f32") {
+            DefaultPrecision = Precision::F32;
+        } else if (Arg == "--precision=f64") {
+            DefaultPrecision = Precision::F64;
+        } else if (Arg == "--whole-program") {
+            WholeProgram = true;
+        } else if (Arg == "--time") {
+            ReportTiming = true;
+        } else if (Arg.rfind("--", 0) == 0) {
+            std::cerr << "Unknown option: " << Arg << std::endl;
+            return 1;
+        } else {
+            inputFile = Arg;
+        }
+    }
+    // Counters live in the compiling process, a module can't refer to them.
+    if (!modulePath.empty() && !ProfileGenPath.empty()) {
+        std::cerr << "--profile-gen can't be used with --emit-module" << std::endl;
+        return 1;
+    }
+    if (!MapFunctionName.empty() && (MapInputPath.empty() || MapOutputPath.empty())) {
+        std::cerr << "--map needs --in and --out" << std::endl;
+        return 1;
+    }
+    // A mapped function is never compiled again, so recording its arguments
+    // would only slow it down, and its threads would race on the histograms.
+    if (!MapFunctionName.empty())
+        ValueProfileThreshold = 0;
     InitializeJIT();
-    InitializeModule();
-    auto inputFile = argc > 1 ? std::string(argv[1]) : "";
+    if (!ProfileUsePath.empty() && !loadProfile())
+        return 1;
+    if (!registerJITEventListeners())
+        return 1;
     if (!inputFile.empty()) {
         std::cout << "Reading from file: " << inputFile << std::endl;
         readFile(inputFile);
     }
+    // The first module picks up the options and file name set above.
+    InitializeModule();
+    if (!modulePath.empty()) {
+        bool Ok = CompileModule(modulePath);
+        closeFile();
+        return Ok ? 0 : 1;
+    }
+    if (!MapFunctionName.empty()) {
+        // The input only provides the definitions.
+        bool Ok = CompileDefinitions(llvm::nulls()) && mapColumns();
+        closeFile();
+        return Ok ? 0 : 1;
+    }
     MainLoop();
     if (!inputFile.empty()) {
         closeFile();
     }
+    if (ValueProfileThreshold > 0)
+        reportValueProfiles();
+    if (!ProfileGenPath.empty() && !writeProfile())
+        return 1;
+    if (!StatsPath.empty() && !writeStats())
+        return 1;
     return 0;
 }
\ No newline at end of file
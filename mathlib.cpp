@@ -0,0 +1,47 @@
+// mathlib.cpp
+#include "mathlib.hpp"
+#include "eval.hpp"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Support/DynamicLibrary.h"
+
+using namespace llvm;
+
+bool UseMathBuiltins = true;
+
+// The vector library TargetLibraryInfo should advertise, if it was loaded.
+static std::optional<TargetLibraryInfoImpl::VectorLibrary> VectorLibrary;
+
+void loadVectorMathLibrary() {
+    if (!UseMathBuiltins)
+        return;
+    const Triple &TT = TheJIT->getTargetMachine().getTargetTriple();
+    // The vectorized functions are looked up in the process like any other
+    // extern, so the library has to be loaded globally.
+    if (TT.isOSLinux() && TT.getArch() == Triple::x86_64 &&
+        !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1"))
+        VectorLibrary = TargetLibraryInfoImpl::LIBMVEC_X86;
+}
+
+void registerMathLibraryInfo(FunctionAnalysisManager &FAM) {
+    const Triple &TT = TheJIT->getTargetMachine().getTargetTriple();
+    TargetLibraryInfoImpl TLII(TT);
+    if (VectorLibrary)
+        TLII.addVectorizableFunctionsFromVecLib(*VectorLibrary, TT);
+    FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+}
+
+Value *emitMathBuiltinCall(const std::string &Callee, Function *CalleeF, ArrayRef<Value *> ArgsV) {
+    // User definitions shadow the math library, as in the evaluator.
+    if (!UseMathBuiltins || !CalleeF->isDeclaration() || FunctionDefs.count(Callee))
+        return nullptr;
+    auto *B = findMathBuiltin(Callee, ArgsV.size());
+    if (!B)
+        return nullptr;
+
+    // Without an intrinsic, the call stays, and the attributes of the
+    // declaration, see purity.hpp, say it only depends on its arguments.
+    if (B->Intrinsic == Intrinsic::not_intrinsic)
+        return nullptr;
+    return Builder->CreateIntrinsic(B->Intrinsic, {numTy()}, ArgsV, nullptr,
+                                    "calltmp");
+}
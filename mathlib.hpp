@@ -0,0 +1,33 @@
+// mathlib.hpp
+#ifndef MATHLIB_HPP
+#define MATHLIB_HPP
+
+#include "ast.hpp"
+#include "llvm/IR/PassManager.h"
+
+// Calls to the known math functions of eval.hpp that are declared with extern
+// are lowered to LLVM intrinsics such as llvm.sin.f64, or .f32 in f32 code, or declared as reading
+// no memory where there is no intrinsic, see purity.hpp. The optimizer can then fold, merge and
+// hoist them, and the loop vectorizer can replace them with calls to a vector
+// math library. Like -fno-math-errno in C, this assumes errno is not read.
+
+// UseMathBuiltins is cleared by --no-math-builtins, which calls the math
+// functions like any other extern.
+extern bool UseMathBuiltins;
+
+// loadVectorMathLibrary loads the vector math library of the host, if it has
+// one the vectorizer knows (libmvec on x86-64 Linux), into the process so
+// that compiled code can call it. It is called once the JIT exists.
+void loadVectorMathLibrary();
+
+// registerMathLibraryInfo registers the TargetLibraryAnalysis describing the
+// host's math library, and the loaded vector library, with FAM. It has to be
+// called before the default analyses are registered.
+void registerMathLibraryInfo(llvm::FunctionAnalysisManager &FAM);
+
+// emitMathBuiltinCall emits the call of CalleeF, named Callee, as a math
+// builtin, or returns nullptr if it isn't one.
+llvm::Value *emitMathBuiltinCall(const std::string &Callee, llvm::Function *CalleeF,
+                                 llvm::ArrayRef<llvm::Value *> ArgsV);
+
+#endif // MATHLIB_HPP
@@ -0,0 +1,114 @@
+#include "module.hpp"
+#include "lexer.hpp"
+#include "stats.hpp"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include <set>
+
+using namespace llvm;
+
+static const char *ProtoTableName = "kaleidoscope.protos";
+
+// Libraries imported so far, a library is only loaded once.
+static std::set<std::string> ImportedModules;
+
+bool writePrecompiledModule(const std::string &Path) {
+    NamedMDNode *Table = TheModule->getOrInsertNamedMetadata(ProtoTableName);
+    for (Function &F : *TheModule) {
+        if (F.isDeclaration())
+            continue;
+        auto &Proto = FunctionProtos[F.getName().str()];
+        std::vector<Metadata *> Fields{MDString::get(*TheContext, Proto->getName())};
+        for (const auto &Arg : Proto->getArgs())
+            Fields.push_back(MDString::get(*TheContext, Arg));
+        Table->addOperand(MDTuple::get(*TheContext, Fields));
+    }
+
+    // Each function was optimized on its own as it was generated. Now that
+    // the whole library is known, optimize across functions once, so that
+    // nobody importing it has to.
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2).run(*TheModule, MAM);
+
+    std::error_code EC;
+    raw_fd_ostream Out(Path, EC, sys::fs::OF_None);
+    if (EC) {
+        fprintf(stderr, "Error: cannot write module %s: %s\n", Path.c_str(),
+                EC.message().c_str());
+        return false;
+    }
+    WriteBitcodeToFile(*TheModule, Out);
+    return true;
+}
+
+// findModuleFile returns the path of Name.kalm, or an empty string.
+static std::string findModuleFile(const std::string &Name) {
+    std::string File = Name + ".kalm";
+    SmallString<128> NextToInput = sys::path::parent_path(SourceFileName);
+    sys::path::append(NextToInput, File);
+    if (sys::fs::exists(NextToInput))
+        return std::string(NextToInput);
+    if (sys::fs::exists(File))
+        return File;
+    return "";
+}
+
+bool importPrecompiledModule(const std::string &Name, raw_ostream &Log) {
+    if (!ImportedModules.insert(Name).second) {
+        Log << "Module " << Name << " is already imported\n";
+        return true;
+    }
+
+    std::string Path = findModuleFile(Name);
+    if (Path.empty()) {
+        LogError(("Cannot find module " + Name + ".kalm").c_str());
+        return false;
+    }
+    auto Buffer = MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+        LogError(("Cannot read module " + Path).c_str());
+        return false;
+    }
+    auto Context = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile((*Buffer)->getMemBufferRef(), *Context);
+    if (!M) {
+        consumeError(M.takeError());
+        LogError(("Not a precompiled module: " + Path).c_str());
+        return false;
+    }
+
+    NamedMDNode *Table = (*M)->getNamedMetadata(ProtoTableName);
+    if (!Table) {
+        LogError(("Module has no prototype table: " + Path).c_str());
+        return false;
+    }
+    for (MDNode *Entry : Table->operands()) {
+        std::vector<std::string> Fields;
+        for (const MDOperand &Field : Entry->operands())
+            Fields.push_back(cast<MDString>(Field)->getString().str());
+        std::string FnName = Fields.front();
+        Fields.erase(Fields.begin());
+        FunctionProtos[FnName] =
+            std::make_unique<PrototypeAST>(SourceLocation{0, 0}, FnName, std::move(Fields));
+        ImportedFunctions.insert(FnName);
+    }
+
+    unsigned NumFunctions = Table->getNumOperands();
+    (*M)->setDataLayout(TheJIT->getDataLayout());
+    trackModule(**M);
+    ExitOnErr(TheJIT->addLibrary(orc::ThreadSafeModule(std::move(*M), std::move(Context)), Name));
+    Log << "Imported " << NumFunctions << " functions from " << Path << "\n";
+    return true;
+}
@@ -0,0 +1,22 @@
+// module.hpp
+#ifndef MODULE_HPP
+#define MODULE_HPP
+
+#include "ast.hpp"
+
+// A precompiled module (.kalm) is the optimized LLVM bitcode of a file of
+// definitions. It also carries a prototype table in the named metadata
+// kaleidoscope.protos, with one tuple per defined function: its name, then the
+// names of its parameters. Importing it rebuilds FunctionProtos from that
+// table and hands the bitcode straight to the JIT, with no lexing, parsing or
+// optimization.
+
+// writePrecompiledModule optimizes TheModule, which holds every definition of
+// the input, and writes it to Path.
+bool writePrecompiledModule(const std::string &Path);
+
+// importPrecompiledModule loads Name.kalm, looking next to the input file
+// first and then in the working directory, into a JITDylib of its own.
+bool importPrecompiledModule(const std::string &Name, llvm::raw_ostream &Log);
+
+#endif // MODULE_HPP
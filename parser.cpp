@@ -6,22 +6,38 @@
 #include <cctype>
 #include <cstdio>
 #include <cstdlib>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <optional>
+#include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "ast.hpp"
+#include "debuginfo.hpp"
+#include "eval.hpp"
 #include "lexer.hpp"
+#include "module.hpp"
+#include "parser.hpp"
+#include "stats.hpp"
+#include "profile.hpp"
+#include "purity.hpp"
+#include "queue.hpp"
+#include <atomic>
+#include <chrono>
 #include <fstream>
 
+bool ReportTiming = false;
+
 static std::unique_ptr<ExprAST> ParsePrimary();
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS);
 static std::unique_ptr<ExprAST> ParseExpression();
 static std::unique_ptr<IfExprAST> ParseIf();
 static std::unique_ptr<ForExprAST> ParseFor();
+static std::unique_ptr<ForExprAST> ParseLoop(SourceLocation Loc, ForExprAST::Reduction Kind);
 
 // + 3 5 -> this returns ExprAST(3)
 static std::unique_ptr<ExprAST> ParseNumberExpr() {
@@ -33,7 +49,23 @@ static std::unique_ptr<ExprAST> ParseNumberExpr() {
 // identifierexpr
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     std::string idName = IdentifierStr;
+    SourceLocation LitLoc = CurLoc;
     getNextToken(); // eat identifier
+    // sum, prod, min and max followed by a loop variable and = start a
+    // reduction. They are not keywords, so they can still name variables and
+    // functions, even right before another item, as in `... else max` and
+    // `f(1, 2)` on the next line.
+    if (CurTok == tok_identifier && peekToken() == '=') {
+        static const std::map<std::string, ForExprAST::Reduction> Reductions = {
+            {"sum", ForExprAST::Reduction::Sum},
+            {"prod", ForExprAST::Reduction::Prod},
+            {"min", ForExprAST::Reduction::Min},
+            {"max", ForExprAST::Reduction::Max},
+        };
+        auto It = Reductions.find(idName);
+        if (It != Reductions.end())
+            return ParseLoop(LitLoc, It->second);
+    }
     // if it is not a function call
     if (CurTok != '(') {
         return std::make_unique<VariableExprAST>(idName);
@@ -57,30 +89,10 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
         }
     }
     getNextToken(); // eat )
-    return std::make_unique<CallExprAST>(idName, std::move(Args));
-}
-
-// parenexpr ::= '(' expression ')'
-// expression
-// (a+b)
-// (a)
-static std::unique_ptr<ExprAST> ParseParentExpr() {
-    getNextToken(); // eat (.
-    auto v = ParseExpression();
-    if (!v)
-        return nullptr;
-    getNextToken(); // eat ).
-    return v;
+    return std::make_unique<CallExprAST>(LitLoc, idName, std::move(Args));
 }
 
 // we only support +, - , *, /, <, >
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParsePrimary();
-    if (!LHS)
-        return nullptr;
-    return ParseBinOpRHS(0, std::move(LHS));
-}
-
 static int getTokPrecedence() {
     switch (CurTok) {
     case '+':
@@ -107,8 +119,6 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
         return ParseNumberExpr();
     case tok_identifier:
         return ParseIdentifierExpr();
-    case '(':
-        return ParseParentExpr();
     case tok_if:
         return ParseIf();
     case tok_for:
@@ -118,26 +128,67 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
     }
 }
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS) {
-    // Does it fail in expressions like a+b# as # is not a valid token
-    // the reason it is while loop is because expr could be as a+b*c*d
+// expression ::= operand (binop operand)*
+// operand ::= '(' expression ')' | primary
+//
+// Operators and parentheses are parsed with explicit stacks instead of
+// recursion (shunting-yard), so an expression can be as long and as deeply
+// parenthesized as memory allows. Operators of equal precedence associate
+// to the left.
+static std::unique_ptr<ExprAST> ParseExpression() {
+    // An operator waiting for its right operand, or an open parenthesis.
+    struct PendingOp {
+        int Op;
+        int Prec;
+        SourceLocation Loc;
+    };
+    std::vector<PendingOp> Ops;
+    std::vector<std::unique_ptr<ExprAST>> Operands;
+    size_t OpenParens = 0;
+
+    // Replace the last two operands by the last operator applied to them.
+    auto Reduce = [&] {
+        PendingOp Op = Ops.back();
+        Ops.pop_back();
+        auto RHS = std::move(Operands.back());
+        Operands.pop_back();
+        auto LHS = std::move(Operands.back());
+        Operands.back() =
+            std::make_unique<BinaryExprAST>(Op.Loc, Op.Op, std::move(LHS), std::move(RHS));
+    };
+
     while (true) {
-        int precedence = getTokPrecedence();
-        if (precedence < ExprPrec) {
-            return LHS;
+        while (CurTok == '(') {
+            Ops.push_back({'(', -1, CurLoc});
+            ++OpenParens;
+            getNextToken(); // eat (.
         }
-        int BinOp = CurTok;
-        getNextToken(); // eat binop
-        auto RHS = ParsePrimary();
-        if (!RHS)
+        auto Operand = ParsePrimary();
+        if (!Operand)
             return nullptr;
-        int NextPrec = getTokPrecedence();
-        if (precedence < NextPrec) {
-            RHS = ParseBinOpRHS(precedence + 1, std::move(RHS));
-            if (!RHS)
-                return nullptr;
+        Operands.push_back(std::move(Operand));
+
+        // A ')' without a matching '(' belongs to the enclosing call.
+        while (CurTok == ')' && OpenParens > 0) {
+            while (Ops.back().Op != '(')
+                Reduce();
+            Ops.pop_back();
+            --OpenParens;
+            getNextToken(); // eat ).
+        }
+
+        int Prec = getTokPrecedence();
+        if (Prec < 0) {
+            if (OpenParens > 0)
+                return LogError("expected ')'");
+            while (!Ops.empty())
+                Reduce();
+            return std::move(Operands.back());
         }
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+        while (!Ops.empty() && Ops.back().Op != '(' && Ops.back().Prec >= Prec)
+            Reduce();
+        Ops.push_back({CurTok, Prec, CurLoc});
+        getNextToken(); // eat binop.
     }
 }
 
@@ -146,8 +197,17 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     if (CurTok != tok_identifier)
         return LogErrorP("Expected function name in prototype");
     std::string FnName = IdentifierStr;
+    SourceLocation FnLoc = CurLoc;
     getNextToken();
 
+    // An f32 or f64 before the name sets the precision of the function.
+    Precision Prec = DefaultPrecision;
+    if ((FnName == "f32" || FnName == "f64") && CurTok == tok_identifier) {
+        Prec = FnName == "f32" ? Precision::F32 : Precision::F64;
+        FnName = IdentifierStr;
+        getNextToken();
+    }
+
     if (CurTok != '(')
         return LogErrorP("Expected '(' in prototype");
 
@@ -160,7 +220,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     }
 
     getNextToken(); // eat )
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+    return std::make_unique<PrototypeAST>(FnLoc, FnName, std::move(ArgNames), Prec);
 }
 
 // parse definition
@@ -183,6 +243,7 @@ static std::unique_ptr<PrototypeAST> ParseExtern() {
 
 // parse if
 static std::unique_ptr<IfExprAST> ParseIf() {
+    SourceLocation IfLoc = CurLoc;
     getNextToken();
     auto Cond = ParseExpression();
     if (!Cond)
@@ -199,14 +260,28 @@ static std::unique_ptr<IfExprAST> ParseIf() {
     auto Else = ParseExpression();
     if (!Else)
         return nullptr;
-    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
+    return std::make_unique<IfExprAST>(IfLoc, std::move(Cond), std::move(Then), std::move(Else));
 }
 
 // parse for
 static std::unique_ptr<ForExprAST> ParseFor() {
+    SourceLocation ForLoc = CurLoc;
     getNextToken(); // eat for
+    return ParseLoop(ForLoc, ForExprAST::Reduction::None);
+}
+
+// parse the rest of a loop, from the loop variable on
+static std::unique_ptr<ForExprAST> ParseLoop(SourceLocation Loc, ForExprAST::Reduction Kind) {
+    if (CurTok != tok_identifier) {
+        LogError("Expected the loop variable");
+        return nullptr;
+    }
     std::string identifier = IdentifierStr;
     getNextToken(); // eat identifier
+    if (CurTok != '=') {
+        LogError("Expected '=' after the loop variable");
+        return nullptr;
+    }
     getNextToken(); // eat =
     auto Start = ParseExpression();
     if (!Start)
@@ -223,114 +298,835 @@ static std::unique_ptr<ForExprAST> ParseFor() {
     auto Body = ParseExpression();
     if (!Body)
         return nullptr;
-    return std::make_unique<ForExprAST>(identifier, std::move(Start), std::move(Cond),
-                                        std::move(Step), std::move(Body));
+    return std::make_unique<ForExprAST>(Loc, identifier, std::move(Start), std::move(Cond),
+                                        std::move(Step), std::move(Body), Kind);
 }
 
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
-        fprintf(stderr, "Parsed a function definition.\n");
-        if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Codegen success handle definition\n");
-            FnIR->print(llvm::errs());
-            fprintf(stderr, "\n");
-        }
+/// import ::= 'import' identifier
+static bool ParseImport(std::string &Name) {
+    getNextToken(); // eat import.
+    if (CurTok != tok_identifier) {
+        LogError("Expected module name after import");
+        return false;
     }
+    Name = IdentifierStr;
+    getNextToken(); // eat module name.
+    return true;
 }
 
-static void HandleExtern() {
-    if (auto ProtoAST = ParseExtern()) {
-        fprintf(stderr, "Parsed an extern\n");
-        if (auto *FnIR = ProtoAST->codegen()) {
-            fprintf(stderr, "Codegen success handle extern\n");
-            FnIR->print(llvm::errs());
-            fprintf(stderr, "\n");
-        }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+/// command ::= ':' identifier
+static bool ParseCommand(std::string &Name) {
+    getNextToken(); // eat ':'.
+    if (CurTok != tok_identifier || IdentifierStr != "stats") {
+        LogError("Unknown command, expected :stats");
+        return false;
     }
+    Name = IdentifierStr;
+    getNextToken(); // eat command name.
+    return true;
 }
 
 /// toplevelexpr ::= expression
 static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+    SourceLocation FnLoc = CurLoc;
     if (auto E = ParseExpression()) {
         // Make an anonymous proto.
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
+        auto Proto =
+            std::make_unique<PrototypeAST>(FnLoc, "__anon_expr", std::vector<std::string>());
         return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
     }
     return nullptr;
 }
 
-static void HandleTopLevelExpression() {
-    if (auto Expr = ParseTopLevelExpr()) {
-        auto fnName = Expr->getProto()->getName();
-        fprintf(stderr, "Parsed a top-level expression.\n");
-        if (auto *FnIR = Expr->codegen()) {
-            fprintf(stderr, "Codegen success handle top level expression\n");
-            FnIR->print(llvm::errs());
-            fprintf(stderr, "\n");
-            // track the resource
-            auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-
-            // Other option is to store all functions in a functionProto map
-            // and then lookup for the function in the map
-            // this will remove dependency to TheModule if only use case of TheModule
-            // is to store functions
-            auto cpyTheModule = llvm::CloneModule(*TheModule.get());
-            auto cpyTheContext = std::make_unique<llvm::LLVMContext>();
-
-            // thread safe module
-            // auto TSM = llvm::orc::ThreadSafeModule(move(TheModule),
-            // move(TheContext));
-            auto TSM =
-                llvm::orc::ThreadSafeModule(std::move(cpyTheModule), std::move(cpyTheContext));
-
-            // add the module to the JIT
-            ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-
-            // search for the symbol
-            auto ExprSymb = ExitOnErr(TheJIT->lookup(fnName));
-
-            double (*FP)() = ExprSymb.getAddress().toPtr<double (*)()>();
-            fprintf(stderr, "\nResult: %f\n", FP());
-            fprintf(stderr, "\n");
-            ExitOnErr(RT->remove());
-            // remove the function from the module
-            FnIR->eraseFromParent();
+// Input is handled in three steps: ParseItem reads one item, the Handle*
+// functions compile it, and RunItem prints what happened and runs the code.
+// Interactive input does the three in a row for each item. File input can run
+// them as a pipeline, each step on its own thread (see PipelinedLoop).
+
+// ParsedItem is one definition, extern or top-level expression of the input.
+struct ParsedItem {
+    enum ItemKind { Skip, Definition, Extern, Import, TopLevel, Command, Close, End } Kind = End;
+    std::unique_ptr<FunctionAST> Fn;
+    std::unique_ptr<PrototypeAST> Proto;
+    // The module name for Import, the command name for Command.
+    std::string Name;
+    bool Failed = false;
+    // Diagnostics of the parse, when they are not printed right away.
+    std::string Log;
+};
+
+// ExecItem is what is left to do once an item is compiled.
+struct ExecItem {
+    enum ExecKind { Print, Evaluated, Interpret, RunJIT, Batch, Close, Stop } Kind = Print;
+    // Output of the earlier steps, when it was not printed right away.
+    std::string Log;
+    // Set for Evaluated.
+    double Result = 0;
+    // Set for Interpret.
+    std::unique_ptr<FunctionAST> Expr;
+    // Set for RunJIT, the tracker frees the expression once it ran.
+    double (*FP)() = nullptr;
+    llvm::orc::ResourceTrackerSP RT;
+    std::chrono::steady_clock::time_point Start;
+    // Set for Batch, see compileBatch: the items in input order, and the
+    // function that runs the compiled ones, which reports the value of each
+    // along with its index in Items. RT frees them once they ran.
+    std::vector<ExecItem> Items;
+    void (*Entry)(void (*Report)(void *, int64_t, double), void *) = nullptr;
+};
+
+static void ParseItem(ParsedItem &Item) {
+    getNextToken();
+    switch (CurTok) {
+    case tok_eof:
+        Item.Kind = ParsedItem::End;
+        break;
+    case ';':
+    case '\n':
+        Item.Kind = ParsedItem::Skip;
+        break;
+    case tok_def:
+        Item.Kind = ParsedItem::Definition;
+        Item.Fn = ParseDefinition();
+        Item.Failed = !Item.Fn;
+        break;
+    case tok_extern:
+        Item.Kind = ParsedItem::Extern;
+        Item.Proto = ParseExtern();
+        Item.Failed = !Item.Proto;
+        if (Item.Failed) {
+            // Skip token for error recovery.
+            getNextToken();
         }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+        break;
+    case tok_import:
+        Item.Kind = ParsedItem::Import;
+        Item.Failed = !ParseImport(Item.Name);
+        break;
+    case ':':
+        Item.Kind = ParsedItem::Command;
+        Item.Failed = !ParseCommand(Item.Name);
+        break;
+    case tok_close:
+        Item.Kind = ParsedItem::Close;
+        break;
+    default:
+        Item.Kind = ParsedItem::TopLevel;
+        Item.Fn = ParseTopLevelExpr();
+        Item.Failed = !Item.Fn;
+        if (Item.Failed) {
+            // Skip token for error recovery.
+            getNextToken();
+        }
+        break;
+    }
+}
+
+// In pipelined mode, items queued for execution may still read the compiler
+// state or call the current function bodies. Submitted and Executed count the
+// queued and finished items, and PendingInterpreted the queued items that
+// will walk the AST. They all stay zero when the steps run in a row.
+static std::atomic<uint64_t> Submitted{0};
+static std::atomic<uint64_t> Executed{0};
+static std::atomic<unsigned> PendingInterpreted{0};
+
+// waitForExecution is called before a definition or extern changes the
+// compiler state. It waits for the queued items that could notice: every
+// item for a redefinition, since they were compiled against the old body.
+static void waitForExecution(bool Redefinition) {
+    if (!Redefinition && PendingInterpreted.load() == 0)
+        return;
+    while (Executed.load() != Submitted.load())
+        std::this_thread::yield();
+}
+
+// Number of bodies compiled so far for each function. Every body gets its own
+// symbol so the old and new code can coexist while the stub is swapped.
+static std::map<std::string, unsigned> FunctionVersions;
+
+// compileDefinition compiles FnAST and points the function's stub at it.
+static bool compileDefinition(FunctionAST &FnAST, llvm::raw_ostream &Log) {
+    auto *FnIR = FnAST.codegen();
+    if (!FnIR)
+        return false;
+    Log << "Codegen success handle definition\n";
+    FnIR->print(Log);
+    Log << "\n";
+
+    // Compile the body on its own and point the function's stub at it,
+    // which frees the previous body if there was one.
+    std::string Name = FnIR->getName().str();
+    std::string ImplName = Name + ".v" + std::to_string(++FunctionVersions[Name]);
+    FnIR->setName(ImplName);
+    finalizeDebugInfo();
+    applyProfileOptimizations(*TheModule);
+    auto Err = TheJIT->addFunction(takeModule(), Name, ImplName);
+    InitializeModule();
+    if (Err) {
+        LogError(llvm::toString(std::move(Err)).c_str());
+        return false;
+    }
+    commitProfiledFunction();
+    ++Stats.DefinitionsCompiled;
+    return true;
+}
+
+static bool HandleDefinition(std::unique_ptr<FunctionAST> FnAST, llvm::raw_ostream &Log) {
+    Log << "Parsed a function definition.\n";
+    std::string Name = FnAST->getProto()->getName();
+    waitForExecution(FunctionDefs.count(Name));
+    resetValueProfile(Name);
+    bool Compiled = compileDefinition(*FnAST, Log);
+    commitValueProfile(Compiled);
+    if (!Compiled)
+        return false;
+    auto &Def = FunctionDefs[Name] = std::move(FnAST);
+
+    // Functions compiled against attributes the new body doesn't have could
+    // have merged, deleted or hoisted its calls, so they are compiled again,
+    // and so are their callers if they lose attributes in turn.
+    std::vector<std::string> Stale = recordFunctionSummary(*Def);
+    while (!Stale.empty()) {
+        std::string Caller = Stale.back();
+        Stale.pop_back();
+        Log << "Recompiling " << Caller << "\n";
+        auto &CallerDef = *FunctionDefs[Caller];
+        if (!compileDefinition(CallerDef, Log))
+            return false;
+        for (auto &N : recordFunctionSummary(CallerDef))
+            Stale.push_back(N);
+    }
+    return true;
+}
+
+// respecialize compiles new bodies for the functions whose value profile
+// calls for one. The code compiled so far keeps calling them through their
+// stubs. In pipelined mode, the queued items are run first, since their code
+// updates the profiles as they are read; value profiling therefore keeps
+// compiling from overlapping with running.
+static void respecialize(llvm::raw_ostream &Log) {
+    if (ValueProfileThreshold == 0)
+        return;
+    waitForExecution(/*Redefinition=*/true);
+    std::vector<std::string> Names = reviewValueProfiles();
+    for (auto &Name : Names) {
+        Log << "Recompiling " << Name << " for its value profile\n";
+        compileDefinition(*FunctionDefs[Name], Log);
+    }
+}
+
+static bool HandleExtern(std::unique_ptr<PrototypeAST> ProtoAST, llvm::raw_ostream &Log) {
+    Log << "Parsed an extern\n";
+    waitForExecution(/*Redefinition=*/false);
+    auto *FnIR = ProtoAST->codegen();
+    if (!FnIR)
+        return false;
+    Log << "Codegen success handle extern\n";
+    FnIR->print(Log);
+    Log << "\n";
+    FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+    return true;
+}
+
+static bool HandleImport(const std::string &Name, llvm::raw_ostream &Log) {
+    Log << "Parsed an import\n";
+    waitForExecution(/*Redefinition=*/false);
+    return importPrecompiledModule(Name, Log);
+}
+
+// Number of top-level expressions compiled so far. Each gets its own symbol,
+// since in pipelined mode the previous ones may not have run yet.
+static uint64_t TopLevelCount = 0;
+
+bool BatchTopLevel = true;
+
+// HandleTopLevelExpression compiles Expr into Exec. With BatchSlot set, an
+// expression that has to be JIT-compiled is left in the current module, as
+// BatchSlot of a batch, instead of being added to the JIT on its own.
+static bool HandleTopLevelExpression(std::unique_ptr<FunctionAST> Expr, ExecItem &Exec,
+                                     llvm::raw_ostream &Log, int BatchSlot = -1) {
+    Log << "Parsed a top-level expression.\n";
+    Exec.Start = std::chrono::steady_clock::now();
+
+    CostEstimator Cost;
+    unsigned EstimatedCost = Cost.estimate(*Expr->getBody());
+
+    // While profiling, everything has to run through the instrumented
+    // code for the counts to be right.
+    bool MayEvaluate = ProfileGenPath.empty();
+
+    // Pure expressions that are cheap enough are answered without
+    // generating any code.
+    unsigned CallBudget = PartialEvalBudget;
+    if (MayEvaluate && PartialEvalBudget > 0 && !Cost.HasSideEffects) {
+        Evaluator E(PartialEvalBudget);
+        if (auto V = E.evaluate(*Expr->getBody())) {
+            Log << "Evaluated at compile time\n";
+            Exec.Kind = ExecItem::Evaluated;
+            Exec.Result = *V;
+            ++Stats.ExpressionsEvaluated;
+            return true;
+        }
+        // Its calls were tried on the way, folding them again during codegen
+        // only gets what the attempt left over.
+        CallBudget = E.remaining();
+    }
+
+    // Short loop-free expressions cost less to interpret than to compile.
+    // The estimate has already checked that every call can be made, so
+    // the interpreter can't fail halfway through a side effect.
+    if (MayEvaluate && EstimatedCost <= InterpretCostThreshold) {
+        Log << "Interpreted\n";
+        Exec.Kind = ExecItem::Interpret;
+        Exec.Expr = std::move(Expr);
+        ++Stats.ExpressionsInterpreted;
+        return true;
+    }
+
+    SpecializeConstantCalls = true;
+    CallEvalBudget = CallBudget;
+    auto *FnIR = Expr->codegen();
+    SpecializeConstantCalls = false;
+    if (!FnIR)
+        return false;
+    Log << "Codegen success handle top level expression\n";
+    FnIR->print(Log);
+    Log << "\n";
+    std::string FnName = "__anon_expr." + std::to_string(++TopLevelCount);
+    FnIR->setName(FnName);
+    ++Stats.ExpressionsCompiled;
+    if (BatchSlot >= 0) {
+        Exec.Kind = ExecItem::RunJIT;
+        return true;
+    }
+
+    // track the resource, so the expression can be freed once it ran.
+    Exec.RT = TheJIT->getMainJITDylib().createResourceTracker();
+    finalizeDebugInfo();
+
+    // The expression gets a module of its own; everything it calls is
+    // reached through the stubs of previously compiled functions.
+    ExitOnErr(TheJIT->addModule(takeModule(), Exec.RT));
+    InitializeModule();
+
+    // search for the symbol
+    auto ExprSymb = ExitOnErr(TheJIT->lookup(FnName));
+    Exec.Kind = ExecItem::RunJIT;
+    Exec.FP = ExprSymb.getAddress().toPtr<double (*)()>();
+    return true;
+}
+
+// CompileItem hands a parsed item to its Handle* function. It returns false
+// if parsing or compiling the item failed.
+static bool CompileItem(ParsedItem &Item, ExecItem &Exec, llvm::raw_ostream &Log) {
+    if (Item.Failed)
+        return false;
+    switch (Item.Kind) {
+    case ParsedItem::Definition:
+        return HandleDefinition(std::move(Item.Fn), Log);
+    case ParsedItem::Extern:
+        return HandleExtern(std::move(Item.Proto), Log);
+    case ParsedItem::Import:
+        return HandleImport(Item.Name, Log);
+    case ParsedItem::TopLevel:
+        return HandleTopLevelExpression(std::move(Item.Fn), Exec, Log);
+    case ParsedItem::Command:
+        // The numbers should include everything before the command.
+        waitForExecution(/*Redefinition=*/true);
+        printStats(Log);
+        return true;
+    case ParsedItem::Close:
+        Exec.Kind = ExecItem::Close;
+        return true;
+    default:
+        return true;
+    }
+}
+
+// ItemReader hands out the parsed items of the input, and lets the compile
+// step look at the next one before taking it.
+class ItemReader {
+    std::function<void(ParsedItem &)> Read;
+    std::optional<ParsedItem> Peeked;
+
+public:
+    explicit ItemReader(std::function<void(ParsedItem &)> Read) : Read(std::move(Read)) {}
+
+    ParsedItem &peek() {
+        if (!Peeked) {
+            Peeked.emplace();
+            Read(*Peeked);
+        }
+        return *Peeked;
+    }
+
+    ParsedItem take() {
+        ParsedItem Item = std::move(peek());
+        Peeked.reset();
+        return Item;
+    }
+};
+
+// emitBatchEntry emits the entry function of a batch of expressions into the
+// current module. It calls the compiled expressions of Items in order, and
+// passes the value of each to Report.
+static llvm::Function *emitBatchEntry(const std::vector<ExecItem> &Items,
+                                      const std::vector<std::string> &Names) {
+    auto *PtrTy = Builder->getPtrTy();
+    auto *ReportTy = llvm::FunctionType::get(Builder->getVoidTy(),
+                                             {PtrTy, Builder->getInt64Ty(), Builder->getDoubleTy()},
+                                             false);
+    auto *EntryTy = llvm::FunctionType::get(Builder->getVoidTy(), {PtrTy, PtrTy}, false);
+    auto *Entry = llvm::Function::Create(EntryTy, llvm::Function::ExternalLinkage,
+                                         "__anon_batch." + std::to_string(TopLevelCount),
+                                         TheModule.get());
+    Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", Entry));
+    Builder->SetCurrentDebugLocation(llvm::DebugLoc());
+    for (size_t I = 0; I < Items.size(); ++I) {
+        if (Items[I].Kind != ExecItem::RunJIT)
+            continue;
+        llvm::Value *V = Builder->CreateCall(TheModule->getFunction(Names[I]), {}, "calltmp");
+        Builder->CreateCall(ReportTy, Entry->getArg(0),
+                            {Entry->getArg(1), Builder->getInt64(I), V});
+    }
+    Builder->CreateRetVoid();
+    llvm::verifyFunction(*Entry);
+    return Entry;
+}
+
+// Items that may be waiting between two steps of the pipeline, and in a batch.
+static const size_t PipelineDepth = 64;
+
+// compileBatch compiles First, a top-level expression of a file, along with
+// up to PipelineDepth - 1 of the ones right after it in Reader, into Exec.
+// The expressions that have to be JIT-compiled share a module with an entry
+// function that runs them in order, which saves the materialization, lookup
+// and removal of a module for each. The others are evaluated or interpreted
+// as usual when their turn comes. The cap lets a long run of expressions
+// start running before all of it is compiled, and bounds the memory a batch
+// holds. It returns false after an item that failed, which ends the batch.
+static bool compileBatch(ParsedItem First, ItemReader &Reader, ExecItem &Exec) {
+    Exec.Kind = ExecItem::Batch;
+    std::vector<std::string> Names;
+    ParsedItem Item = std::move(First);
+    bool Ok;
+    while (true) {
+        ExecItem &Sub = Exec.Items.emplace_back();
+        {
+            llvm::raw_string_ostream Log(Sub.Log);
+            Log << Item.Log;
+            Diagnostics = &Log;
+            Ok = !Item.Failed &&
+                 HandleTopLevelExpression(std::move(Item.Fn), Sub, Log, Exec.Items.size() - 1);
+            Diagnostics = nullptr;
+        }
+        Names.push_back(Sub.Kind == ExecItem::RunJIT ? "__anon_expr." + std::to_string(TopLevelCount)
+                                                     : "");
+        if (!Ok || Exec.Items.size() == PipelineDepth)
+            break;
+        while (Reader.peek().Kind == ParsedItem::Skip)
+            Reader.take();
+        if (Reader.peek().Kind != ParsedItem::TopLevel)
+            break;
+        Item = Reader.take();
+    }
+
+    bool Compiled = llvm::any_of(
+        Exec.Items, [](const ExecItem &Sub) { return Sub.Kind == ExecItem::RunJIT; });
+    if (!Compiled)
+        return Ok;
+    std::string EntryName = emitBatchEntry(Exec.Items, Names)->getName().str();
+    Exec.RT = TheJIT->getMainJITDylib().createResourceTracker();
+    finalizeDebugInfo();
+    ExitOnErr(TheJIT->addModule(takeModule(), Exec.RT));
+    InitializeModule();
+    auto EntrySymb = ExitOnErr(TheJIT->lookup(EntryName));
+    Exec.Entry = EntrySymb.getAddress().toPtr<decltype(Exec.Entry)>();
+    return Ok;
+}
+
+// compileNext compiles Item into Exec, and in file mode the top-level
+// expressions that follow it too, if it is one. Diagnostics go into Exec, to
+// be printed when it runs.
+static bool compileNext(ParsedItem Item, ItemReader &Reader, ExecItem &Exec) {
+    if (BatchTopLevel && Item.Kind == ParsedItem::TopLevel)
+        return compileBatch(std::move(Item), Reader, Exec);
+    llvm::raw_string_ostream Log(Exec.Log);
+    Log << Item.Log;
+    Diagnostics = &Log;
+    bool Ok = CompileItem(Item, Exec, Log);
+    Diagnostics = nullptr;
+    return Ok;
+}
+
+// interprets tells if running Exec walks the AST, see waitForExecution.
+static bool interprets(const ExecItem &Exec) {
+    return Exec.Kind == ExecItem::Interpret ||
+           llvm::any_of(Exec.Items, [](const ExecItem &Sub) { return interprets(Sub); });
+}
+
+// printResult reports the value of a top-level expression, and how long it
+// took to get it when timing is on.
+static void printResult(double Result, const char *Mode,
+                        std::chrono::steady_clock::time_point Start) {
+    fprintf(stderr, "\nResult: %f\n", Result);
+    if (ReportTiming) {
+        std::chrono::duration<double, std::micro> Took = std::chrono::steady_clock::now() - Start;
+        fprintf(stderr, "Took: %.3f us (%s)\n", Took.count(), Mode);
+    }
+    fprintf(stderr, "\n");
+}
+
+static void RunItem(ExecItem &Exec);
+
+// BatchRun is the progress through the items of a batch, as its entry
+// function reports the compiled ones.
+struct BatchRun {
+    std::vector<ExecItem> &Items;
+    size_t Next = 0;
+
+    // runUntil runs the items before End that were not compiled.
+    void runUntil(size_t End) {
+        for (; Next < End; ++Next)
+            RunItem(Items[Next]);
+    }
+
+    static void report(void *Ctx, int64_t Slot, double Result) {
+        auto &Run = *static_cast<BatchRun *>(Ctx);
+        Run.runUntil(Slot);
+        fputs(Run.Items[Slot].Log.c_str(), stderr);
+        printResult(Result, "jit", Run.Items[Slot].Start);
+        Run.Next = Slot + 1;
+    }
+};
+
+static void RunItem(ExecItem &Exec) {
+    fputs(Exec.Log.c_str(), stderr);
+    switch (Exec.Kind) {
+    case ExecItem::Evaluated:
+        printResult(Exec.Result, "compile time", Exec.Start);
+        break;
+    case ExecItem::Interpret: {
+        auto V = Evaluator(CostEstimator::Unbounded, /*AllowSideEffects=*/true)
+                     .evaluate(*Exec.Expr->getBody());
+        printResult(V.value_or(0.0), "interpreted", Exec.Start);
+        break;
+    }
+    case ExecItem::RunJIT:
+        printResult(Exec.FP(), "jit", Exec.Start);
+        ExitOnErr(Exec.RT->remove());
+        break;
+    case ExecItem::Batch: {
+        BatchRun Run{Exec.Items};
+        if (Exec.Entry)
+            Exec.Entry(BatchRun::report, &Run);
+        Run.runUntil(Exec.Items.size());
+        if (Exec.RT)
+            ExitOnErr(Exec.RT->remove());
+        break;
+    }
+    case ExecItem::Close:
+        std::cout << "Close\n";
+        break;
+    default:
+        break;
+    }
+}
+
+bool PipelineFileMode = false;
+bool WholeProgram = false;
+
+// printTotals reports, with --time, how the time spent on a file splits
+// between compiling and running it.
+static void printTotals(std::chrono::steady_clock::duration Compile,
+                        std::chrono::steady_clock::duration Run) {
+    using Ms = std::chrono::duration<double, std::milli>;
+    fprintf(stderr, "Compile time: %.3f ms, run time: %.3f ms\n", Ms(Compile).count(),
+            Ms(Run).count());
+}
+
+// PipelinedLoop runs the parsing, compiling and executing steps on their own
+// threads, connected by queues. Items still go through each step in input
+// order, so the output is the same as when the steps run in a row. Errors
+// are carried along as text and reported when execution reaches them.
+static void PipelinedLoop() {
+    SPSCQueue<ParsedItem> Parsed(PipelineDepth);
+    SPSCQueue<ExecItem> Compiled(PipelineDepth);
+
+    std::thread ParseStep([&] {
+        while (true) {
+            ParsedItem Item;
+            {
+                llvm::raw_string_ostream Log(Item.Log);
+                Diagnostics = &Log;
+                ParseItem(Item);
+                Diagnostics = nullptr;
+            }
+            bool Last = Item.Kind == ParsedItem::End;
+            // There is nothing more to do after close or a fatal error.
+            bool Stop = Item.Kind == ParsedItem::Close || (Item.Failed && EXIT_ON_ERROR);
+            Parsed.push(std::move(Item));
+            if (Stop)
+                Parsed.push(ParsedItem());
+            if (Last || Stop)
+                return;
+        }
+    });
+
+    std::thread ExecuteStep([&] {
+        while (true) {
+            ExecItem Exec = Compiled.pop();
+            if (Exec.Kind == ExecItem::Stop)
+                return;
+            RunItem(Exec);
+            if (interprets(Exec))
+                --PendingInterpreted;
+            ++Executed;
+        }
+    });
+
+    // Compile on this thread, the module and builder globals belong to it.
+    ItemReader Reader([&](ParsedItem &Item) { Item = Parsed.pop(); });
+    bool Fatal = false;
+    while (true) {
+        ParsedItem Item = Reader.take();
+        if (Item.Kind == ParsedItem::End)
+            break;
+        // After a fatal error, only wait for the parser to stop.
+        if (Fatal)
+            continue;
+
+        {
+            llvm::raw_string_ostream Log(Item.Log);
+            respecialize(Log);
+        }
+        ExecItem Exec;
+        bool Ok = compileNext(std::move(Item), Reader, Exec);
+        if (!Ok && EXIT_ON_ERROR)
+            Fatal = true;
+        if (interprets(Exec))
+            ++PendingInterpreted;
+        ++Submitted;
+        Compiled.push(std::move(Exec));
+    }
+
+    ExecItem Stop;
+    Stop.Kind = ExecItem::Stop;
+    Compiled.push(std::move(Stop));
+    ExecuteStep.join();
+    ParseStep.join();
+    if (Fatal)
+        exit(1);
+}
+
+// FileLoop runs file input one step at a time like the interactive loop,
+// except that it reads ahead to batch top-level expressions, so diagnostics
+// are kept with their item until it runs.
+static void FileLoop() {
+    ItemReader Reader([](ParsedItem &Item) {
+        llvm::raw_string_ostream Log(Item.Log);
+        Diagnostics = &Log;
+        ParseItem(Item);
+        Diagnostics = nullptr;
+    });
+    std::chrono::steady_clock::duration CompileTime{}, RunTime{};
+    while (true) {
+        auto Start = std::chrono::steady_clock::now();
+        ParsedItem Item = Reader.take();
+        if (Item.Kind == ParsedItem::End)
+            break;
+        bool Close = Item.Kind == ParsedItem::Close;
+        {
+            llvm::raw_string_ostream Log(Item.Log);
+            respecialize(Log);
+        }
+        ExecItem Exec;
+        bool Ok = compileNext(std::move(Item), Reader, Exec);
+        auto Compiled = std::chrono::steady_clock::now();
+        RunItem(Exec);
+        CompileTime += Compiled - Start;
+        RunTime += std::chrono::steady_clock::now() - Compiled;
+        if (!Ok && EXIT_ON_ERROR)
+            exit(1);
+        if (Close)
+            break;
+    }
+    if (ReportTiming)
+        printTotals(CompileTime, RunTime);
+}
+
+// WholeProgramLoop reads the whole file before compiling any of it. The
+// definitions and the compiled top-level expressions go into one module,
+// with a batch entry function (see compileBatch) as its only entry point, so
+// that the module can be optimized as a closed program and materialized
+// once. With nothing compiled separately, nothing can be redefined either.
+static void WholeProgramLoop() {
+    auto Start = std::chrono::steady_clock::now();
+    std::vector<ParsedItem> Items;
+    std::set<std::string> Defined;
+    while (true) {
+        ParsedItem &Item = Items.emplace_back();
+        {
+            llvm::raw_string_ostream Log(Item.Log);
+            Diagnostics = &Log;
+            ParseItem(Item);
+            if (!Item.Failed && Item.Kind == ParsedItem::Definition &&
+                !Defined.insert(Item.Fn->getProto()->getName()).second) {
+                LogError(("Function cannot be redefined in whole-program mode: " +
+                          Item.Fn->getProto()->getName())
+                             .c_str());
+                Item.Failed = true;
+            }
+            Diagnostics = nullptr;
+        }
+        // Errors stop the program before any of it runs.
+        if (Item.Failed) {
+            fputs(Item.Log.c_str(), stderr);
+            exit(1);
+        }
+        if (Item.Kind == ParsedItem::End || Item.Kind == ParsedItem::Close)
+            break;
+    }
+
+    ExecItem Exec;
+    Exec.Kind = ExecItem::Batch;
+    std::vector<std::string> Names;
+    for (auto &Item : Items) {
+        llvm::raw_ostream &Log = llvm::errs();
+        // The logs of expressions are printed when their turn comes.
+        if (Item.Kind != ParsedItem::TopLevel)
+            fputs(Item.Log.c_str(), stderr);
+        bool Ok = true;
+        switch (Item.Kind) {
+        case ParsedItem::Definition: {
+            Ok = Item.Fn->codegen() != nullptr;
+            if (Ok) {
+                commitProfiledFunction();
+                std::string Name = Item.Fn->getProto()->getName();
+                recordFunctionSummary(*(FunctionDefs[Name] = std::move(Item.Fn)));
+                ++Stats.DefinitionsCompiled;
+            }
+            break;
+        }
+        case ParsedItem::TopLevel: {
+            ExecItem &Sub = Exec.Items.emplace_back();
+            llvm::raw_string_ostream SubLog(Sub.Log);
+            SubLog << Item.Log;
+            Ok = HandleTopLevelExpression(std::move(Item.Fn), Sub, SubLog,
+                                          Exec.Items.size() - 1);
+            Names.push_back(Sub.Kind == ExecItem::RunJIT
+                                ? "__anon_expr." + std::to_string(TopLevelCount)
+                                : "");
+            break;
+        }
+        case ParsedItem::Close:
+            Exec.Items.emplace_back().Kind = ExecItem::Close;
+            Names.push_back("");
+            break;
+        default:
+            Ok = CompileItem(Item, Exec, Log);
+            break;
+        }
+        if (!Ok)
+            exit(1);
+    }
+
+    bool AnyCompiled = llvm::any_of(
+        Exec.Items, [](const ExecItem &Sub) { return Sub.Kind == ExecItem::RunJIT; });
+    if (AnyCompiled) {
+        std::string EntryName = emitBatchEntry(Exec.Items, Names)->getName().str();
+        optimizeWholeProgram(*TheModule, EntryName);
+        finalizeDebugInfo();
+        ExitOnErr(TheJIT->addModule(takeModule()));
+        InitializeModule();
+        auto EntrySymb = ExitOnErr(TheJIT->lookup(EntryName));
+        Exec.Entry = EntrySymb.getAddress().toPtr<decltype(Exec.Entry)>();
     }
+    auto Compiled = std::chrono::steady_clock::now();
+    RunItem(Exec);
+    if (ReportTiming)
+        printTotals(Compiled - Start, std::chrono::steady_clock::now() - Compiled);
 }
 
 void MainLoop() {
+    if (WholeProgram && isFileSet())
+        return WholeProgramLoop();
+    if (PipelineFileMode && isFileSet())
+        return PipelinedLoop();
+    if (BatchTopLevel && isFileSet())
+        return FileLoop();
+
     while (true) {
+        // every time before get next token, print the prompt
         if (!isFileSet()) {
             fprintf(stderr, "ready>");
         }
-        // every time before get next token, print the prompt
-        getNextToken();
-        switch (CurTok) {
-        case tok_eof:
+        ParsedItem Item;
+        ParseItem(Item);
+        if (Item.Kind == ParsedItem::End)
             return;
-        case ';':
-            break;
-        case '\n':
+        respecialize(llvm::errs());
+        ExecItem Exec;
+        if (CompileItem(Item, Exec, llvm::errs()))
+            RunItem(Exec);
+        if (Item.Kind == ParsedItem::Close)
+            return;
+    }
+}
+
+bool CompileModule(const std::string &OutputPath) {
+    // Everything goes into TheModule, which becomes the precompiled module.
+    while (true) {
+        ParsedItem Item;
+        ParseItem(Item);
+        if (Item.Failed)
+            return false;
+        switch (Item.Kind) {
+        case ParsedItem::End:
+            return writePrecompiledModule(OutputPath);
+        case ParsedItem::Skip:
             break;
-        case tok_def:
-            HandleDefinition();
+        case ParsedItem::Definition: {
+            if (!Item.Fn->codegen())
+                return false;
+            // Later definitions in the module see what this one does.
+            std::string Name = Item.Fn->getProto()->getName();
+            recordFunctionSummary(*(FunctionDefs[Name] = std::move(Item.Fn)));
             break;
-        case tok_extern:
-            HandleExtern();
+        }
+        case ParsedItem::Extern: {
+            auto &Proto = Item.Proto;
+            if (!Proto->codegen())
+                return false;
+            FunctionProtos[Proto->getName()] = std::move(Proto);
             break;
-        case tok_close:
-            std::cout << "Close\n";
-            return;
+        }
         default:
-            HandleTopLevelExpression();
+            LogError("Only definitions and externs can be compiled into a module");
+            return false;
+        }
+    }
+}
+
+bool CompileDefinitions(llvm::raw_ostream &Log) {
+    while (true) {
+        ParsedItem Item;
+        ParseItem(Item);
+        if (Item.Failed)
+            return false;
+        switch (Item.Kind) {
+        case ParsedItem::End:
+            return true;
+        case ParsedItem::TopLevel:
+        case ParsedItem::Close:
+            LogError("Only definitions, externs and imports can be compiled here");
+            return false;
+        default: {
+            ExecItem Exec;
+            if (!CompileItem(Item, Exec, Log))
+                return false;
             break;
         }
+        }
     }
-}
\ No newline at end of file
+}
@@ -6,4 +6,31 @@
 
 void MainLoop();
 
+// CompileModule compiles the definitions and externs of the input into a
+// precompiled module written to OutputPath, see module.hpp.
+bool CompileModule(const std::string &OutputPath);
+
+// CompileDefinitions compiles the definitions, externs and imports of the
+// input and adds them to the JIT, see engine.hpp. It stops at the first
+// error, and rejects top-level expressions.
+bool CompileDefinitions(llvm::raw_ostream &Log);
+
+// ReportTiming prints how long each top-level expression took to evaluate,
+// and whether it was interpreted or compiled.
+extern bool ReportTiming;
+
+// PipelineFileMode parses, compiles and runs file input on three threads, so
+// that the steps for consecutive items overlap.
+extern bool PipelineFileMode;
+
+// BatchTopLevel compiles each run of top-level expressions in file input into
+// one module, instead of one module per expression. Cleared by --no-batch.
+extern bool BatchTopLevel;
+
+// WholeProgram compiles file input as one program, see WholeProgramLoop:
+// every definition and compiled top-level expression goes into one module,
+// optimized across functions and materialized once. Redefinitions are
+// rejected.
+extern bool WholeProgram;
+
 #endif // PARSER_HPP
\ No newline at end of file
@@ -0,0 +1,397 @@
+#include "profile.hpp"
+#include "eval.hpp"
+#include "llvm/ADT/bit.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Transforms/IPO/HotColdSplitting.h"
+#include <fstream>
+#include <sstream>
+
+using namespace llvm;
+
+std::string ProfileGenPath;
+std::string ProfileUsePath;
+
+// Counters written to by generated code. Each new body gets fresh counters,
+// and old ones are never freed since code using them may still be running.
+static std::deque<FunctionCounts> CounterPool;
+static std::map<std::string, FunctionCounts *> LiveCounts;
+
+// Counts read from ProfileUsePath.
+static std::map<std::string, FunctionCounts> LoadedCounts;
+
+// State for the body being generated. Its counters only replace the live
+// ones once it is compiled, see commitProfiledFunction.
+static std::string CurName;
+static FunctionCounts *CurCounters = nullptr;
+static const FunctionCounts *CurWeights = nullptr;
+static unsigned NextBranch = 0;
+
+bool isProfiling() { return !ProfileGenPath.empty() || !ProfileUsePath.empty(); }
+
+// The file has one line per function: its name, entry count, then the
+// taken/not-taken counts of each of its ifs.
+bool loadProfile() {
+    std::ifstream In(ProfileUsePath);
+    if (!In.is_open()) {
+        fprintf(stderr, "Error: cannot read profile %s\n", ProfileUsePath.c_str());
+        return false;
+    }
+    std::string Line;
+    while (std::getline(In, Line)) {
+        if (Line.empty() || Line[0] == '#')
+            continue;
+        std::istringstream Fields(Line);
+        std::string Name;
+        FunctionCounts Counts;
+        if (!(Fields >> Name >> Counts.Entry))
+            continue;
+        uint64_t N;
+        while (Fields >> N)
+            Counts.Arms.push_back(N);
+        LoadedCounts[Name] = std::move(Counts);
+    }
+    return true;
+}
+
+bool writeProfile() {
+    std::ofstream Out(ProfileGenPath);
+    if (!Out.is_open()) {
+        fprintf(stderr, "Error: cannot write profile %s\n", ProfileGenPath.c_str());
+        return false;
+    }
+    Out << "# kaleidoscope profile: name entry-count [taken not-taken]...\n";
+    for (const auto &[Name, Counts] : LiveCounts) {
+        Out << Name << " " << Counts->Entry;
+        for (uint64_t N : Counts->Arms)
+            Out << " " << N;
+        Out << "\n";
+    }
+    return true;
+}
+
+void beginProfiledFunction(const std::string &Name) {
+    CurCounters = nullptr;
+    CurWeights = nullptr;
+    NextBranch = 0;
+    // Top-level expressions run once, there is nothing to learn about them.
+    if (!isProfiling() || Name == "__anon_expr")
+        return;
+
+    auto LI = LoadedCounts.find(Name);
+    if (LI != LoadedCounts.end())
+        CurWeights = &LI->second;
+
+    if (ProfileGenPath.empty())
+        return;
+    auto Live = LiveCounts.find(Name);
+    if (!CurWeights && Live != LiveCounts.end() && Live->second->Entry > 0)
+        CurWeights = Live->second;
+    CounterPool.emplace_back();
+    CurCounters = &CounterPool.back();
+    CurName = Name;
+}
+
+void commitProfiledFunction() {
+    if (CurCounters)
+        LiveCounts[CurName] = CurCounters;
+}
+
+// emitIncrement adds one to the counter at C. The add is atomic, since
+// --map may run the code on several threads at once.
+static void emitIncrement(IRBuilder<> &B, uint64_t *C) {
+    Value *Ptr = B.CreateIntToPtr(B.getInt64(reinterpret_cast<uintptr_t>(C)),
+                                  PointerType::getUnqual(B.getContext()));
+    B.CreateAtomicRMW(AtomicRMWInst::Add, Ptr, B.getInt64(1), MaybeAlign(8),
+                      AtomicOrdering::Monotonic);
+}
+
+void profileFunctionEntry(Function *F) {
+    if (CurCounters)
+        emitIncrement(*Builder, &CurCounters->Entry);
+    if (!CurWeights)
+        return;
+    F->setEntryCount(CurWeights->Entry);
+    // Functions the profile never saw called are kept out of the way of the
+    // hot code.
+    if (CurWeights->Entry == 0)
+        F->addFnAttr(Attribute::Cold);
+}
+
+void profileBranch(BranchInst *Br) {
+    unsigned Idx = 2 * NextBranch++;
+    if (CurCounters) {
+        CurCounters->Arms.resize(Idx + 2);
+        for (unsigned i = 0; i != 2; ++i) {
+            IRBuilder<> B(Br->getSuccessor(i), Br->getSuccessor(i)->begin());
+            emitIncrement(B, &CurCounters->Arms[Idx + i]);
+        }
+    }
+    if (!CurWeights || CurWeights->Arms.size() < Idx + 2)
+        return;
+
+    // Branch weights are 32 bits, scale the counts down until they fit.
+    uint64_t Taken = CurWeights->Arms[Idx], NotTaken = CurWeights->Arms[Idx + 1];
+    while (std::max(Taken, NotTaken) > UINT32_MAX) {
+        Taken >>= 1;
+        NotTaken >>= 1;
+    }
+    Br->setMetadata(LLVMContext::MD_prof,
+                    MDBuilder(Br->getContext()).createBranchWeights(Taken, NotTaken));
+}
+
+// buildSummary summarizes the counts the weights come from, which lets
+// passes tell hot code from cold.
+static std::unique_ptr<ProfileSummary> buildSummary() {
+    InstrProfSummaryBuilder SummaryBuilder(ProfileSummaryBuilder::DefaultCutoffs.vec());
+    auto AddCounts = [&](const FunctionCounts &Counts) {
+        std::vector<uint64_t> All{Counts.Entry};
+        All.insert(All.end(), Counts.Arms.begin(), Counts.Arms.end());
+        SummaryBuilder.addRecord(InstrProfRecord(std::move(All)));
+    };
+    if (!LoadedCounts.empty()) {
+        for (const auto &[Name, Counts] : LoadedCounts)
+            AddCounts(Counts);
+    } else {
+        for (const auto &[Name, Counts] : LiveCounts)
+            AddCounts(*Counts);
+    }
+    return SummaryBuilder.getSummary();
+}
+
+void applyProfileOptimizations(Module &M) {
+    if (!isProfiling())
+        return;
+    M.setProfileSummary(buildSummary()->getMD(M.getContext()), ProfileSummary::PSK_Instr);
+
+    // Move blocks the profile marks as cold out of line, so the hot path of
+    // each function stays compact.
+    ModulePassManager MPM;
+    MPM.addPass(HotColdSplittingPass());
+    MPM.run(M, *TheMAM);
+}
+
+uint64_t ValueProfileThreshold = 0;
+
+// ArgHistogram counts the values an argument was called with, by their bits.
+// The slots hold the most frequent values seen so far, most frequent first,
+// and Other counts the calls whose value found no free slot.
+struct ArgHistogram {
+    static const unsigned Slots = 4;
+    uint64_t Bits[Slots] = {};
+    uint64_t Counts[Slots] = {};
+    uint64_t Other = 0;
+
+    uint64_t calls() const {
+        uint64_t N = Other;
+        for (uint64_t C : Counts)
+            N += C;
+        return N;
+    }
+};
+
+// ValueProfile is the state of one body: recording its arguments, specialized
+// on argument Arg having the bits Value, or done with either.
+struct ValueProfile {
+    enum { Recording, Specialized, Done } State = Recording;
+    std::vector<ArgHistogram> Args;
+    unsigned Arg = 0;
+    uint64_t Value = 0;
+    uint64_t Hits = 0, Misses = 0;
+};
+
+// Like the counters above, profiles are never freed, and a new body gets a
+// fresh one.
+static std::deque<ValueProfile> ValueProfilePool;
+static std::map<std::string, ValueProfile *> ValueProfiles;
+
+// The profile of a new body until it is compiled, see commitValueProfile.
+static std::string PendingName;
+static ValueProfile *PendingProfile = nullptr;
+
+void resetValueProfile(const std::string &Name) {
+    if (ValueProfileThreshold == 0)
+        return;
+    ValueProfilePool.emplace_back();
+    PendingProfile = &ValueProfilePool.back();
+    PendingName = Name;
+}
+
+void commitValueProfile(bool Compiled) {
+    if (PendingProfile && Compiled)
+        ValueProfiles[PendingName] = PendingProfile;
+    PendingProfile = nullptr;
+}
+
+// findValueProfile returns the profile the code generated for Name uses.
+static ValueProfile *findValueProfile(const std::string &Name) {
+    if (PendingProfile && PendingName == Name)
+        return PendingProfile;
+    auto PI = ValueProfiles.find(Name);
+    return PI == ValueProfiles.end() ? nullptr : PI->second;
+}
+
+bool emitsValueProfile(const std::string &Name) {
+    ValueProfile *P = findValueProfile(Name);
+    return P && P->State != ValueProfile::Done;
+}
+
+// recordValue is called by generated code when the value of an argument is
+// not the one in the first slot. It keeps the slots sorted by count, so that
+// the check in generated code mostly hits. It is not thread-safe: generated
+// code only runs on one thread at a time while value profiling, since --map
+// turns it off, and profiles are only reviewed once queued code has run.
+static void recordValue(ArgHistogram *H, uint64_t Bits) {
+    for (unsigned i = 0; i != ArgHistogram::Slots; ++i) {
+        if (H->Counts[i] == 0)
+            H->Bits[i] = Bits;
+        if (H->Bits[i] != Bits)
+            continue;
+        for (++H->Counts[i]; i > 0 && H->Counts[i] > H->Counts[i - 1]; --i) {
+            std::swap(H->Bits[i], H->Bits[i - 1]);
+            std::swap(H->Counts[i], H->Counts[i - 1]);
+        }
+        return;
+    }
+    ++H->Other;
+}
+
+// emitRecordValue counts V in H: inline when it has the bits of the first
+// slot, through recordValue otherwise.
+static void emitRecordValue(Function *F, ArgHistogram *H, Value *V) {
+    Type *PtrTy = PointerType::getUnqual(*TheContext);
+    auto Addr = [&](const void *P) {
+        return Builder->CreateIntToPtr(Builder->getInt64(reinterpret_cast<uintptr_t>(P)), PtrTy);
+    };
+    Value *Bits = Builder->CreateBitCast(V, Builder->getInt64Ty(), "bits");
+    Value *First = Builder->CreateLoad(Builder->getInt64Ty(), Addr(&H->Bits[0]), "vprof.first");
+    BasicBlock *HitBB = BasicBlock::Create(*TheContext, "vprof.hit", F);
+    BasicBlock *MissBB = BasicBlock::Create(*TheContext, "vprof.miss", F);
+    BasicBlock *ContBB = BasicBlock::Create(*TheContext, "vprof.cont", F);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(Bits, First), HitBB, MissBB);
+
+    Builder->SetInsertPoint(HitBB);
+    emitIncrement(*Builder, &H->Counts[0]);
+    Builder->CreateBr(ContBB);
+
+    Builder->SetInsertPoint(MissBB);
+    auto *RecordTy =
+        FunctionType::get(Builder->getVoidTy(), {PtrTy, Builder->getInt64Ty()}, false);
+    Builder->CreateCall(RecordTy, Addr(reinterpret_cast<const void *>(&recordValue)),
+                        {Addr(H), Bits});
+    Builder->CreateBr(ContBB);
+
+    Builder->SetInsertPoint(ContBB);
+}
+
+void emitValueProfile(FunctionAST &Def, Function *F) {
+    ValueProfile *PP = findValueProfile(Def.getProto()->getName());
+    if (!PP || F->arg_size() == 0)
+        return;
+    ValueProfile &P = *PP;
+
+    if (P.State == ValueProfile::Recording) {
+        P.Args.resize(F->arg_size());
+        for (unsigned i = 0; i != F->arg_size(); ++i)
+            emitRecordValue(F, &P.Args[i], F->getArg(i));
+        return;
+    }
+    if (P.State != ValueProfile::Specialized)
+        return;
+
+    // Compare bits rather than values, so that 0.0 and -0.0 are told apart.
+    Value *Bits = Builder->CreateBitCast(F->getArg(P.Arg), Builder->getInt64Ty(), "bits");
+    BasicBlock *SpecBB = BasicBlock::Create(*TheContext, "vprof.spec", F);
+    BasicBlock *GenericBB = BasicBlock::Create(*TheContext, "vprof.generic", F);
+    auto *Br = Builder->CreateCondBr(Builder->CreateICmpEQ(Bits, Builder->getInt64(P.Value)),
+                                     SpecBB, GenericBB);
+    const ArgHistogram &H = P.Args[P.Arg];
+    uint64_t Taken = H.Counts[0], NotTaken = H.calls() - Taken;
+    while (std::max(Taken, NotTaken) > UINT32_MAX) {
+        Taken >>= 1;
+        NotTaken >>= 1;
+    }
+    Br->setMetadata(LLVMContext::MD_prof,
+                    MDBuilder(*TheContext).createBranchWeights(Taken, NotTaken));
+
+    Builder->SetInsertPoint(SpecBB);
+    emitIncrement(*Builder, &P.Hits);
+    std::vector<Value *> ArgsV;
+    for (auto &Arg : F->args())
+        ArgsV.push_back(&Arg);
+    ArgsV[P.Arg] = ConstantFP::get(*TheContext, APFloat(bit_cast<double>(P.Value)));
+    if (Function *Clone = emitSpecialization(Def, ArgsV)) {
+        std::vector<Value *> CloneArgs;
+        for (Value *V : ArgsV)
+            if (!isa<ConstantFP>(V))
+                CloneArgs.push_back(V);
+        auto *Call = Builder->CreateCall(Clone, CloneArgs, "calltmp");
+        Call->setTailCall();
+        Builder->CreateRet(Call);
+    } else {
+        Builder->CreateBr(GenericBB);
+    }
+
+    Builder->SetInsertPoint(GenericBB);
+    emitIncrement(*Builder, &P.Misses);
+}
+
+std::vector<std::string> reviewValueProfiles() {
+    std::vector<std::string> Recompile;
+    for (auto &[Name, P] : ValueProfiles) {
+        if (P->State == ValueProfile::Recording) {
+            if (P->Args.empty() || P->Args[0].calls() < ValueProfileThreshold)
+                continue;
+            // Specialize on the argument with the most frequent value, if it
+            // has that value in at least 80% of the calls.
+            unsigned Best = 0;
+            for (unsigned i = 1; i != P->Args.size(); ++i)
+                if (P->Args[i].Counts[0] > P->Args[Best].Counts[0])
+                    Best = i;
+            const ArgHistogram &H = P->Args[Best];
+            if (H.Counts[0] * 5 >= H.calls() * 4) {
+                P->State = ValueProfile::Specialized;
+                P->Arg = Best;
+                P->Value = H.Bits[0];
+            } else {
+                P->State = ValueProfile::Done;
+            }
+            Recompile.push_back(Name);
+        } else if (P->State == ValueProfile::Specialized) {
+            // The calls may have moved on to other values.
+            if (P->Hits + P->Misses >= ValueProfileThreshold && P->Misses > P->Hits) {
+                P->State = ValueProfile::Done;
+                Recompile.push_back(Name);
+            }
+        }
+    }
+    return Recompile;
+}
+
+void reportValueProfiles() {
+    fprintf(stderr, "Value profile:\n");
+    for (const auto &[Name, P] : ValueProfiles) {
+        auto FI = FunctionProtos.find(Name);
+        if (FI == FunctionProtos.end())
+            continue;
+        const auto &Params = FI->second->getArgs();
+        uint64_t Calls = P->Args.empty() ? 0 : P->Args[0].calls();
+        uint64_t Guarded = P->Hits + P->Misses;
+        if (P->State == ValueProfile::Specialized || Guarded > 0) {
+            fprintf(stderr, "  %s: specialized on %s = %g", Name.c_str(), Params[P->Arg].c_str(),
+                    bit_cast<double>(P->Value));
+            if (Guarded > 0)
+                fprintf(stderr, ", guard hit %.1f%% of %llu calls", 100.0 * P->Hits / Guarded,
+                        (unsigned long long)Guarded);
+            fprintf(stderr, "%s\n",
+                    P->State == ValueProfile::Done ? ", dropped for missing too often" : "");
+        } else if (P->State == ValueProfile::Done) {
+            fprintf(stderr, "  %s: no dominant argument value in %llu calls\n", Name.c_str(),
+                    (unsigned long long)Calls);
+        } else if (P->State == ValueProfile::Recording && Calls > 0) {
+            fprintf(stderr, "  %s: %llu calls recorded, below the threshold\n", Name.c_str(),
+                    (unsigned long long)Calls);
+        }
+    }
+}
@@ -0,0 +1,82 @@
+// profile.hpp
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include "ast.hpp"
+#include <deque>
+
+// ProfileGenPath is set by --profile-gen. Generated functions then count how
+// often they are entered and which way each if goes, and the counts are
+// written to the file at exit.
+extern std::string ProfileGenPath;
+
+// ProfileUsePath is set by --profile-use. Counts from an earlier run are read
+// from it and turned into entry counts and branch weights.
+extern std::string ProfileUsePath;
+
+// FunctionCounts holds the profile of one function body: its entry count and
+// a taken/not-taken pair for each if, numbered in the order codegen reaches
+// them.
+struct FunctionCounts {
+    uint64_t Entry = 0;
+    std::deque<uint64_t> Arms;
+};
+
+bool isProfiling();
+bool loadProfile();
+bool writeProfile();
+
+// beginProfiledFunction is called before generating a new body for Name. It
+// picks the counts used for its weights: the loaded profile if there is one,
+// otherwise what the previous body counted in this session.
+void beginProfiledFunction(const std::string &Name);
+
+// commitProfiledFunction is called once the body last begun is compiled. Its
+// counters then replace those of the previous body, which keep theirs if the
+// new one fails.
+void commitProfiledFunction();
+
+// profileFunctionEntry instruments the entry block of F, which must be the
+// insert point, and sets its entry count.
+void profileFunctionEntry(llvm::Function *F);
+
+// profileBranch instruments both successors of the branch of an if, and
+// attaches branch weights to it.
+void profileBranch(llvm::BranchInst *Br);
+
+// applyProfileOptimizations runs the profile-driven module passes, such as
+// hot/cold splitting, on M.
+void applyProfileOptimizations(llvm::Module &M);
+
+// ValueProfileThreshold is set by --value-profile. User functions then record
+// the values their arguments are called with. Once a function has been called
+// that many times and one argument mostly had the same value, it is compiled
+// again with a guarded call to a clone specialized on that value.
+extern uint64_t ValueProfileThreshold;
+
+// resetValueProfile starts the value profile of Name over, for a new body.
+// The new profile replaces the old one once commitValueProfile is called with
+// Compiled set; the previous body keeps its profile if the new one failed.
+void resetValueProfile(const std::string &Name);
+void commitValueProfile(bool Compiled);
+
+// emitsValueProfile tells if the body generated for Name records its
+// arguments or counts its guard, which writes memory.
+bool emitsValueProfile(const std::string &Name);
+
+// emitValueProfile is called at the entry of the body of Def, after the
+// prologue. It records the arguments of F or, once Def has been specialized,
+// emits the guard and the call to the clone, leaving the insert point on the
+// generic path.
+void emitValueProfile(FunctionAST &Def, llvm::Function *F);
+
+// reviewValueProfiles returns the functions whose value profile calls for a
+// new body: specialized, back to generic because the guard misses too often,
+// or without recording when no value stands out.
+std::vector<std::string> reviewValueProfiles();
+
+// reportValueProfiles prints the decision for each profiled function, and
+// how often the guards hit.
+void reportValueProfiles();
+
+#endif // PROFILE_HPP
@@ -0,0 +1,162 @@
+// purity.cpp
+#include "purity.hpp"
+#include "eval.hpp"
+#include "mathlib.hpp"
+#include "profile.hpp"
+
+using namespace llvm;
+
+bool InferAttributes = true;
+
+// The summaries of the compiled user functions, and for each of them the
+// functions whose summary and code were computed from it.
+static std::map<std::string, FunctionSummary> Summaries;
+static std::map<std::string, std::set<std::string>> Callers;
+static std::map<std::string, std::set<std::string>> CalleesOf;
+
+FunctionSummary getFunctionSummary(const std::string &Name, size_t Arity) {
+    // User definitions shadow the math library.
+    auto It = Summaries.find(Name);
+    if (It != Summaries.end())
+        return It->second;
+    if (UseMathBuiltins && findMathBuiltin(Name, Arity))
+        return {true, true, true};
+    return {};
+}
+
+void PurityAnalysis::noteCall(const std::string &Callee, size_t NumArgs) {
+    if (Callee == Self) {
+        // Assume the function is pure until the rest of the body shows
+        // otherwise, but it may not return.
+        Summary.WillReturn = false;
+        return;
+    }
+    if (Summaries.count(Callee))
+        Callees.insert(Callee);
+    FunctionSummary S = getFunctionSummary(Callee, NumArgs);
+    Summary.ReadNone &= S.ReadNone;
+    Summary.NoUnwind &= S.NoUnwind;
+    Summary.WillReturn &= S.WillReturn;
+}
+
+void NumberExprAST::inferPurity(PurityAnalysis &P) {}
+
+void VariableExprAST::inferPurity(PurityAnalysis &P) {}
+
+void BinaryExprAST::inferPurity(PurityAnalysis &P) {
+    auto Leaf = [&](ExprAST &X) -> std::optional<bool> {
+        P.visit(X);
+        return true;
+    };
+    auto Combine = [](BinaryExprAST &, bool, bool) -> std::optional<bool> { return true; };
+    fold<bool>(Leaf, Combine);
+}
+
+void CallExprAST::inferPurity(PurityAnalysis &P) {
+    P.noteCall(Callee, Args.size());
+    for (auto &Arg : Args)
+        P.visit(*Arg);
+}
+
+void IfExprAST::inferPurity(PurityAnalysis &P) {
+    P.visit(*Cond);
+    P.visit(*Then);
+    P.visit(*Else);
+}
+
+void ForExprAST::inferPurity(PurityAnalysis &P) {
+    // The condition may never become false.
+    P.noteLoop();
+    P.visit(*Start);
+    P.visit(*Cond);
+    P.visit(*Step);
+    P.visit(*Body);
+}
+
+// reaches returns whether one of the functions in From calls Name, directly or
+// through others, going by the bodies compiled so far.
+static bool reaches(const std::set<std::string> &From, const std::string &Name) {
+    std::set<std::string> Seen;
+    std::vector<std::string> Work(From.begin(), From.end());
+    while (!Work.empty()) {
+        std::string F = std::move(Work.back());
+        Work.pop_back();
+        if (F == Name)
+            return true;
+        if (!Seen.insert(F).second)
+            continue;
+        auto It = CalleesOf.find(F);
+        if (It != CalleesOf.end())
+            Work.insert(Work.end(), It->second.begin(), It->second.end());
+    }
+    return false;
+}
+
+static FunctionSummary inferFunctionSummary(FunctionAST &Def, std::set<std::string> *Callees) {
+    // Instrumented bodies write to their counters.
+    if (!InferAttributes || !ProfileGenPath.empty())
+        return {};
+    const std::string &Name = Def.getProto()->getName();
+    PurityAnalysis P(Name);
+    P.visit(*Def.getBody());
+    // The summaries of the callees were computed against the previous body
+    // of Name, which the new one may turn into a cycle of calls.
+    if (P.Summary.WillReturn && reaches(P.Callees, Name))
+        P.Summary.WillReturn = false;
+    // Value profiling writes the histograms and guard counts.
+    if (emitsValueProfile(Name))
+        P.Summary.ReadNone = false;
+    if (Callees)
+        *Callees = std::move(P.Callees);
+    return P.Summary;
+}
+
+FunctionSummary inferFunctionSummary(FunctionAST &Def) {
+    return inferFunctionSummary(Def, nullptr);
+}
+
+std::vector<std::string> recordFunctionSummary(FunctionAST &Def) {
+    const std::string &Name = Def.getProto()->getName();
+    std::set<std::string> Callees;
+    FunctionSummary S = inferFunctionSummary(Def, &Callees);
+
+    // The previous body may have called other functions.
+    for (auto &Callee : CalleesOf[Name])
+        Callers[Callee].erase(Name);
+    for (auto &Callee : Callees)
+        Callers[Callee].insert(Name);
+    CalleesOf[Name] = std::move(Callees);
+
+    auto It = Summaries.find(Name);
+    bool Lost = It != Summaries.end() &&
+                ((It->second.ReadNone && !S.ReadNone) || (It->second.NoUnwind && !S.NoUnwind) ||
+                 (It->second.WillReturn && !S.WillReturn));
+    Summaries[Name] = S;
+    if (!Lost)
+        return {};
+    auto &C = Callers[Name];
+    return std::vector<std::string>(C.begin(), C.end());
+}
+
+void applyFunctionSummary(Function &F, const FunctionSummary &S) {
+    if (S.ReadNone)
+        F.setDoesNotAccessMemory();
+    else
+        F.removeFnAttr(Attribute::Memory);
+    if (S.NoUnwind)
+        F.setDoesNotThrow();
+    else
+        F.removeFnAttr(Attribute::NoUnwind);
+    if (S.WillReturn)
+        F.addFnAttr(Attribute::WillReturn);
+    else
+        F.removeFnAttr(Attribute::WillReturn);
+
+    // Kaleidoscope code has no undefined behavior, so such a call can run
+    // where the program wouldn't have run it. LICM needs that to hoist calls
+    // out of the body of a for loop, which may run zero times.
+    if (S.ReadNone && S.NoUnwind && S.WillReturn)
+        F.addFnAttr(Attribute::Speculatable);
+    else
+        F.removeFnAttr(Attribute::Speculatable);
+}
@@ -0,0 +1,62 @@
+// purity.hpp
+#ifndef PURITY_HPP
+#define PURITY_HPP
+
+#include "ast.hpp"
+#include <set>
+
+// What is known about the behavior of a function, inferred from its body and
+// the summaries of the functions it calls. It becomes attributes on the
+// function and on its declarations in other modules, so the optimizer can
+// merge, delete and hoist calls to it out of loops.
+struct FunctionSummary {
+    // No memory is accessed: the only externs called are known math functions.
+    bool ReadNone = false;
+    // No exception unwinds out of it, for the same reason.
+    bool NoUnwind = false;
+    // Every call returns: there are no loops and no recursion.
+    bool WillReturn = false;
+};
+
+// InferAttributes is cleared by --no-infer-attrs, which leaves user functions
+// without attributes. The known math functions of eval.hpp keep theirs.
+extern bool InferAttributes;
+
+// PurityAnalysis walks a function body to compute its summary.
+class PurityAnalysis {
+    std::string Self;
+
+public:
+    explicit PurityAnalysis(const std::string &Self) : Self(Self) {}
+
+    FunctionSummary Summary{true, true, true};
+
+    // The user functions whose summaries were relied on.
+    std::set<std::string> Callees;
+
+    void visit(ExprAST &E) { E.inferPurity(*this); }
+    void noteCall(const std::string &Callee, size_t NumArgs);
+    void noteLoop() { Summary.WillReturn = false; }
+};
+
+// getFunctionSummary returns what is known about the function or extern Name
+// taking Arity arguments.
+FunctionSummary getFunctionSummary(const std::string &Name, size_t Arity);
+
+// inferFunctionSummary computes the summary of Def. Bodies instrumented by
+// --profile-gen get an empty one, and those that record or guard on their
+// argument values for --value-profile access memory.
+FunctionSummary inferFunctionSummary(FunctionAST &Def);
+
+// recordFunctionSummary makes the summary of Def, which has just been
+// compiled, the one later callers see. If a redefinition lost a property that
+// callers compiled earlier rely on, it returns them so they can be compiled
+// again. That includes a redefinition that makes Def call itself through
+// them, which they have to learn doesn't return.
+std::vector<std::string> recordFunctionSummary(FunctionAST &Def);
+
+// applyFunctionSummary sets the attributes of F from S, and clears the ones S
+// doesn't allow.
+void applyFunctionSummary(llvm::Function &F, const FunctionSummary &S);
+
+#endif // PURITY_HPP
@@ -0,0 +1,42 @@
+// queue.hpp
+#ifndef QUEUE_HPP
+#define QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// SPSCQueue is a bounded lock-free queue between exactly one producer thread
+// and one consumer thread. push waits while the queue is full, and pop waits
+// while it is empty.
+template <typename T> class SPSCQueue {
+    std::vector<T> Slots;
+
+    // Head is only written by the consumer and Tail only by the producer. They
+    // sit on separate cache lines so the two threads don't fight over one.
+    alignas(64) std::atomic<size_t> Head{0};
+    alignas(64) std::atomic<size_t> Tail{0};
+
+public:
+    explicit SPSCQueue(size_t Capacity) : Slots(Capacity) {}
+
+    void push(T Item) {
+        size_t Pos = Tail.load(std::memory_order_relaxed);
+        while (Pos - Head.load(std::memory_order_acquire) == Slots.size())
+            std::this_thread::yield();
+        Slots[Pos % Slots.size()] = std::move(Item);
+        Tail.store(Pos + 1, std::memory_order_release);
+    }
+
+    T pop() {
+        size_t Pos = Head.load(std::memory_order_relaxed);
+        while (Tail.load(std::memory_order_acquire) == Pos)
+            std::this_thread::yield();
+        T Item = std::move(Slots[Pos % Slots.size()]);
+        Head.store(Pos + 1, std::memory_order_release);
+        return Item;
+    }
+};
+
+#endif // QUEUE_HPP
@@ -0,0 +1,160 @@
+// scan.cpp
+#include "scan.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+enum CharClass { Space, Ident, Number, Comment };
+
+template <CharClass C> static inline bool inClass(unsigned char Ch) {
+    switch (C) {
+    case Space:
+        return Ch == ' ' || (unsigned char)(Ch - '\t') <= '\r' - '\t';
+    case Ident:
+        return (unsigned char)((Ch | 0x20) - 'a') <= 'z' - 'a' || (unsigned char)(Ch - '0') <= 9;
+    case Number:
+        return Ch == '.' || (unsigned char)(Ch - '0') <= 9;
+    case Comment:
+        return Ch != '\n' && Ch != '\r' && Ch != 0xff;
+    }
+    return false;
+}
+
+template <CharClass C> static const char *scanScalar(const char *P, const char *End) {
+    while (P != End && inClass<C>(*P))
+        ++P;
+    return P;
+}
+
+#if defined(__x86_64__)
+
+// The bytes of V in [Lo, Lo + N], as 0xff lanes. SSE2 only compares signed
+// bytes, but the unsigned minimum does the job.
+static inline __m128i inRange(__m128i V, char Lo, char N) {
+    __m128i X = _mm_sub_epi8(V, _mm_set1_epi8(Lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(X, _mm_set1_epi8(N)), X);
+}
+
+template <CharClass C> static inline __m128i classMask(__m128i V) {
+    switch (C) {
+    case Space:
+        return _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8(' ')),
+                            inRange(V, '\t', '\r' - '\t'));
+    case Ident:
+        return _mm_or_si128(inRange(_mm_or_si128(V, _mm_set1_epi8(0x20)), 'a', 'z' - 'a'),
+                            inRange(V, '0', 9));
+    case Number:
+        return _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('.')), inRange(V, '0', 9));
+    case Comment:
+        return _mm_andnot_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+                                      _mm_cmpeq_epi8(V, _mm_set1_epi8('\r'))),
+                         _mm_cmpeq_epi8(V, _mm_set1_epi8((char)0xff))),
+            _mm_set1_epi8((char)0xff));
+    }
+    return _mm_setzero_si128();
+}
+
+template <CharClass C> static const char *scanSSE2(const char *P, const char *End) {
+    while (End - P >= 16) {
+        __m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i *>(P));
+        unsigned Out = ~_mm_movemask_epi8(classMask<C>(V)) & 0xffff;
+        if (Out)
+            return P + __builtin_ctz(Out);
+        P += 16;
+    }
+    return scanScalar<C>(P, End);
+}
+
+__attribute__((target("avx2"))) static inline __m256i inRange256(__m256i V, char Lo, char N) {
+    __m256i X = _mm256_sub_epi8(V, _mm256_set1_epi8(Lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(X, _mm256_set1_epi8(N)), X);
+}
+
+template <CharClass C>
+__attribute__((target("avx2"))) static inline __m256i classMask256(__m256i V) {
+    switch (C) {
+    case Space:
+        return _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8(' ')),
+                               inRange256(V, '\t', '\r' - '\t'));
+    case Ident:
+        return _mm256_or_si256(
+            inRange256(_mm256_or_si256(V, _mm256_set1_epi8(0x20)), 'a', 'z' - 'a'),
+            inRange256(V, '0', 9));
+    case Number:
+        return _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('.')),
+                               inRange256(V, '0', 9));
+    case Comment:
+        return _mm256_andnot_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')),
+                                            _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\r'))),
+                            _mm256_cmpeq_epi8(V, _mm256_set1_epi8((char)0xff))),
+            _mm256_set1_epi8((char)0xff));
+    }
+    return _mm256_setzero_si256();
+}
+
+template <CharClass C>
+__attribute__((target("avx2"))) static const char *scanAVX2(const char *P, const char *End) {
+    while (End - P >= 32) {
+        __m256i V = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(P));
+        unsigned Out = ~(unsigned)_mm256_movemask_epi8(classMask256<C>(V));
+        if (Out)
+            return P + __builtin_ctz(Out);
+        P += 32;
+    }
+    return scanSSE2<C>(P, End);
+}
+
+#endif
+
+template <CharClass C> static const char *scanScalarFn(const char *P, const char *End) {
+    return scanScalar<C>(P, End);
+}
+
+static const Scanners ScalarScanners = {"scalar", scanScalarFn<Space>, scanScalarFn<Ident>,
+                                  scanScalarFn<Number>, scanScalarFn<Comment>};
+#if defined(__x86_64__)
+static const Scanners SSE2Scanners = {"sse2", scanSSE2<Space>, scanSSE2<Ident>, scanSSE2<Number>,
+                               scanSSE2<Comment>};
+static const Scanners AVX2Scanners = {"avx2", scanAVX2<Space>, scanAVX2<Ident>, scanAVX2<Number>,
+                               scanAVX2<Comment>};
+#endif
+
+static const Scanners *pickScanners() {
+#if defined(__x86_64__)
+    // Every x86-64 CPU has SSE2.
+    if (__builtin_cpu_supports("avx2"))
+        return &AVX2Scanners;
+    return &SSE2Scanners;
+#else
+    return &ScalarScanners;
+#endif
+}
+
+static const Scanners *Current = nullptr;
+
+const Scanners &getScanners() {
+    if (!Current)
+        Current = pickScanners();
+    return *Current;
+}
+
+bool setScanners(const std::string &Name) {
+    if (Name == "scalar") {
+        Current = &ScalarScanners;
+        return true;
+    }
+#if defined(__x86_64__)
+    if (Name == "sse2") {
+        Current = &SSE2Scanners;
+        return true;
+    }
+    if (Name == "avx2" && __builtin_cpu_supports("avx2")) {
+        Current = &AVX2Scanners;
+        return true;
+    }
+#endif
+    return false;
+}
@@ -0,0 +1,32 @@
+// scan.hpp
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <string>
+
+// Scanners find the end of a run of characters of one class in the lexer's
+// input buffer. Each returns the first position in [P, End) whose character
+// is not in the class, or End. The classes follow the lexer: whitespace is
+// isspace in the C locale, identifier characters are [A-Za-z0-9], number
+// characters [0-9.], and a comment runs until '\n', '\r' or a 0xff byte,
+// which readChar reads as EOF.
+//
+// On x86-64 they compare 32 (AVX2) or 16 (SSE2) bytes at a time. The
+// implementation is picked on first use from the features of the CPU, and
+// gives the same results as the scalar loops used everywhere else.
+struct Scanners {
+    const char *Name;
+    const char *(*Whitespace)(const char *P, const char *End);
+    const char *(*Identifier)(const char *P, const char *End);
+    const char *(*Number)(const char *P, const char *End);
+    const char *(*Comment)(const char *P, const char *End);
+};
+
+// getScanners returns the implementation in use.
+const Scanners &getScanners();
+
+// setScanners switches to the implementation called Name ("scalar", "sse2"
+// or "avx2"). It returns false if there is none or the CPU can't run it.
+bool setScanners(const std::string &Name);
+
+#endif // SCAN_HPP
@@ -0,0 +1,134 @@
+// stats.cpp
+#include "stats.hpp"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include <mutex>
+#include <sys/resource.h>
+
+using namespace llvm;
+
+SessionStats Stats;
+std::string StatsPath;
+
+void *CountedAllocation::operator new(size_t Size) {
+    Stats.ASTBytes += Size;
+    ++Stats.ASTNodes;
+    return ::operator new(Size);
+}
+
+void CountedAllocation::operator delete(void *P, size_t Size) {
+    Stats.ASTBytes -= Size;
+    --Stats.ASTNodes;
+    ::operator delete(P);
+}
+
+// LLVM doesn't say how much memory IR takes, so it is estimated from the
+// objects that make it up. It is a lower bound: names, constants, types and
+// metadata aren't counted.
+static uint64_t estimateIRBytes(const Module &M) {
+    uint64_t Bytes = sizeof(Module);
+    for (const Function &F : M) {
+        Bytes += sizeof(Function) + F.arg_size() * sizeof(Argument);
+        for (const BasicBlock &BB : F) {
+            Bytes += sizeof(BasicBlock);
+            for (const Instruction &I : BB)
+                Bytes += sizeof(Instruction) + I.getNumOperands() * sizeof(Use);
+        }
+    }
+    return Bytes;
+}
+
+// Modules handed to the JIT and not compiled yet, with their estimated size.
+// Each has a context of its own, which goes away with it.
+static std::mutex PendingMutex;
+static std::map<const Module *, uint64_t> PendingModules;
+static uint64_t PendingIRBytes = 0;
+
+void initStats() {
+    TheJIT->setNotifyCompiled([](orc::MaterializationResponsibility &, orc::ThreadSafeModule TSM) {
+        ++Stats.ModulesCompiled;
+        TSM.withModuleDo([](Module &M) {
+            std::lock_guard<std::mutex> Lock(PendingMutex);
+            auto I = PendingModules.find(&M);
+            if (I == PendingModules.end())
+                return;
+            PendingIRBytes -= I->second;
+            PendingModules.erase(I);
+        });
+    });
+}
+
+void trackModule(const Module &M) {
+    uint64_t Bytes = estimateIRBytes(M);
+    std::lock_guard<std::mutex> Lock(PendingMutex);
+    PendingModules[&M] = Bytes;
+    PendingIRBytes += Bytes;
+}
+
+// getPeakRSS returns the largest resident set size of the process in KiB.
+static uint64_t getPeakRSS() {
+    struct rusage Usage;
+    if (getrusage(RUSAGE_SELF, &Usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return Usage.ru_maxrss / 1024;
+#else
+    return Usage.ru_maxrss;
+#endif
+}
+
+// The counters as name/value pairs, in the order they are printed.
+static std::vector<std::pair<const char *, int64_t>> collectStats() {
+    // The module being built counts too, it has its own context.
+    uint64_t LiveModules, IRBytes;
+    {
+        std::lock_guard<std::mutex> Lock(PendingMutex);
+        LiveModules = PendingModules.size();
+        IRBytes = PendingIRBytes;
+    }
+    if (TheModule) {
+        ++LiveModules;
+        IRBytes += estimateIRBytes(*TheModule);
+    }
+    using MM = orc::AccountingMemoryManager;
+    return {
+        {"ast_bytes", Stats.ASTBytes.load()},
+        {"ast_nodes", Stats.ASTNodes.load()},
+        {"ir_bytes", (int64_t)IRBytes},
+        {"live_modules", (int64_t)LiveModules},
+        {"jit_objects", (int64_t)MM::Objects.load()},
+        {"jit_code_bytes", (int64_t)MM::CodeBytes.load()},
+        {"jit_data_bytes", (int64_t)MM::DataBytes.load()},
+        {"function_protos", (int64_t)FunctionProtos.size()},
+        {"function_defs", (int64_t)FunctionDefs.size()},
+        {"named_values", (int64_t)NamedValues.size()},
+        {"definitions_compiled", (int64_t)Stats.DefinitionsCompiled.load()},
+        {"expressions_evaluated", (int64_t)Stats.ExpressionsEvaluated.load()},
+        {"expressions_interpreted", (int64_t)Stats.ExpressionsInterpreted.load()},
+        {"expressions_compiled", (int64_t)Stats.ExpressionsCompiled.load()},
+        {"specializations", (int64_t)Stats.Specializations.load()},
+        {"modules_compiled", (int64_t)Stats.ModulesCompiled.load()},
+        {"peak_rss_kib", (int64_t)getPeakRSS()},
+    };
+}
+
+void printStats(raw_ostream &OS) {
+    for (const auto &[Name, Value] : collectStats())
+        OS << format("%-24s %lld\n", Name, (long long)Value);
+}
+
+bool writeStats() {
+    std::error_code EC;
+    raw_fd_ostream OS(StatsPath, EC);
+    if (EC) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", StatsPath.c_str(), EC.message().c_str());
+        return false;
+    }
+    json::OStream J(OS, /*IndentSize=*/2);
+    J.object([&] {
+        for (const auto &[Name, Value] : collectStats())
+            J.attribute(Name, Value);
+    });
+    OS << "\n";
+    return true;
+}
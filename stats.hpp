@@ -0,0 +1,43 @@
+// stats.hpp
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include "ast.hpp"
+#include <atomic>
+
+// Counters describing the memory held by a session and the work done so far.
+// The memory counters only cover what is still alive: AST nodes, modules
+// waiting to be compiled, and the code and data of loaded objects (see
+// AccountingMemoryManager in jit.hpp). :stats prints them, and --stats=FILE
+// writes them as JSON at exit.
+struct SessionStats {
+    // Bytes and number of live AST nodes, see CountedAllocation in ast.hpp.
+    std::atomic<int64_t> ASTBytes{0};
+    std::atomic<int64_t> ASTNodes{0};
+
+    std::atomic<uint64_t> DefinitionsCompiled{0};
+    std::atomic<uint64_t> ExpressionsEvaluated{0};
+    std::atomic<uint64_t> ExpressionsInterpreted{0};
+    std::atomic<uint64_t> ExpressionsCompiled{0};
+    std::atomic<uint64_t> Specializations{0};
+    std::atomic<uint64_t> ModulesCompiled{0};
+};
+
+extern SessionStats Stats;
+
+// StatsPath is set by --stats.
+extern std::string StatsPath;
+
+// initStats starts following the modules compiled by the JIT.
+void initStats();
+
+// trackModule records M as handed over to the JIT, until it is compiled.
+void trackModule(const llvm::Module &M);
+
+// printStats writes the counters in a readable form, for :stats.
+void printStats(llvm::raw_ostream &OS);
+
+// writeStats writes the counters to StatsPath as JSON, one key per line.
+bool writeStats();
+
+#endif // STATS_HPP